@@ -60,6 +60,32 @@ public:
     static bool has_value(const std::string& diacritic); 
 };
 
+/** \brief The operator, feature and value of a flag diacritic packed
+    together without its name, for applying during lookup. A default one
+    is not a diacritic.
+*/
+class FdPackedOperation
+{
+private:
+    unsigned char op;
+    FdFeature feature;
+    FdValue value;
+
+    static const unsigned char NOT_A_DIACRITIC = 0xff;
+public:
+    FdPackedOperation():
+    op(NOT_A_DIACRITIC), feature(0), value(0) {}
+
+    FdPackedOperation(const FdOperation& operation):
+    op(operation.Operator()), feature(operation.Feature()),
+    value(operation.Value()) {}
+
+    bool is_diacritic(void) const { return op != NOT_A_DIACRITIC; }
+    FdOperator Operator(void) const { return static_cast<FdOperator>(op); }
+    FdFeature Feature(void) const { return feature; }
+    FdValue Value(void) const { return value; }
+};
+
 template<class T> class FdState;
   
 /** \brief A collection of the flag diacritics from a symbol table indexed
@@ -131,13 +157,23 @@ public:
       
     const FdOperation* get_operation(T symbol) const
         {
-          // for some reason this fails to compile???
-          //std::map<T,FdOperation>::const_iterator i 
-          //  = operations.find(symbol);
-          //return (i==operations.end()) ? NULL : &(i->second);
-        
-          return (operations.find(symbol)==operations.end()) ? NULL : 
-            &(operations.find(symbol)->second);
+            typename std::map<T,FdOperation>::const_iterator i
+              = operations.find(symbol);
+            return (i==operations.end()) ? NULL : &(i->second);
+        }
+
+    /** The operations of symbols 0 to \a symbol_count - 1 in a flat
+        vector, for testing and applying with one indexed load */
+    std::vector<FdPackedOperation> pack_operations(T symbol_count) const
+        {
+            std::vector<FdPackedOperation> packed(symbol_count);
+            for (typename std::map<T,FdOperation>::const_iterator i
+                   = operations.begin(); i != operations.end(); ++i)
+            {
+                if (i->first < symbol_count)
+                    packed[i->first] = FdPackedOperation(i->second);
+            }
+            return packed;
         }
     const FdOperation* get_operation(const std::string& symbol) const
         {
@@ -216,6 +252,14 @@ public:
         }
     }
 
+    // An operation changes at most the value of its own feature, so
+    // putting that back undoes it
+    FdValue get_value(FdFeature feature) const
+    { return values[feature]; }
+
+    void set_value(FdFeature feature, FdValue value)
+    { values[feature] = value; }
+
     bool apply_operation(T symbol)
         {
             const FdOperation* op = table->get_operation(symbol);
@@ -224,6 +268,13 @@ public:
             return true; // if the symbol isn't a diacritic
         }    
     bool apply_operation(const FdOperation& op)
+        { return apply(op); }
+    bool apply_operation(const FdPackedOperation& op)
+        { return apply(op); }
+
+    // Op is either an FdOperation or an FdPackedOperation
+    template<class Op>
+    bool apply(const Op& op)
         {
             switch(op.Operator()) {
             case Pop: // positive set
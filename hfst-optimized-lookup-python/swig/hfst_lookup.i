@@ -4,6 +4,7 @@
 %include "std_vector.i"
 %include "std_pair.i"
 %include "std_map.i"
+%include "std_except.i"
 
 %{
 #define SWIG_FILE_WITH_INIT
@@ -19,13 +20,30 @@ namespace std {
 }
 
 namespace hfst_ol {
+class TransducerModel;
+class LookupContext;
 class Transducer;
 //class Speller;
 
-class Transducer{
+class TransducerModel{
+public:
+    TransducerModel(const std::string & filename);
+    bool is_infinitely_ambiguous(void) const;
+};
+
+class LookupContext{
+public:
+    LookupContext(const TransducerModel & model);
+    std::vector<std::pair<std::string, float> > lookup(const std::string & input);
+};
+
+%catches(std::invalid_argument) Transducer::set_lookup_limits;
+
+class Transducer : public TransducerModel{
 public:
     Transducer(const std::string & filename);
     std::vector<std::pair<std::string, float> > lookup(const std::string & input);
+    void set_lookup_limits(size_t max_epsilon_depth, size_t max_analyses);
 };
 }
 
@@ -2,16 +2,32 @@ from libcpp.string cimport string
 from libcpp.vector cimport vector
 
 cdef extern from "transducer.h" namespace 'hfst_ol':
+    cdef struct CacheStats:
+        unsigned long long hits
+        unsigned long long misses
+        unsigned long long evictions
+        size_t entries
+        size_t bytes
+
     cdef cppclass Transducer:
         Transducer(const string filename) except +
-        vector[string] multi_lookup(vector[string] input_file)
+        Transducer(const string filename, size_t cache_bytes) except +
+        vector[string] multi_lookup(vector[string] input_file) nogil except +
+        vector[vector[string]] multi_doc_lookup(vector[string] docs, size_t threads) nogil except +
         void write_lookup_cache()
+        void save_lookup_cache(const string filename) except +
+        bint load_lookup_cache(const string filename)
+        CacheStats cache_stats()
+        void clear_cache()
+        void set_lookup_limits(size_t max_epsilon_depth, size_t max_analyses) except +
+        bint is_infinitely_ambiguous()
 
 
 cdef class PyTransducer:
     cdef Transducer *t
-    def __cinit__(self):
-        self.t = new Transducer('morphology.finntreebank.hfstol')
+    def __cinit__(self, filename='morphology.finntreebank.hfstol',
+                  cache_bytes=64 << 20):
+        self.t = new Transducer(filename.encode(), cache_bytes)
 
     def __dealloc__(self):
         del self.t
@@ -19,8 +35,36 @@ cdef class PyTransducer:
     def multi_lookup(self, list_of_strings):
         cdef vector[string] retvals
         list_of_bytes = [string.encode() for string in list_of_strings]
-        retvals = self.t.multi_lookup(list_of_bytes)
+        cdef vector[string] inputs = list_of_bytes
+        with nogil:
+            retvals = self.t.multi_lookup(inputs)
         retval_py = list()
         for val in retvals:
             retval_py.append(val.decode())
         return retval_py
+
+    def multi_doc_lookup(self, docs, threads=0):
+        cdef vector[vector[string]] retvals
+        cdef vector[string] inputs = [doc.encode() for doc in docs]
+        cdef size_t thread_count = threads
+        with nogil:
+            retvals = self.t.multi_doc_lookup(inputs, thread_count)
+        return [[val.decode() for val in doc] for doc in retvals]
+
+    def cache_stats(self):
+        return self.t.cache_stats()
+
+    def clear_cache(self):
+        self.t.clear_cache()
+
+    def save_lookup_cache(self, filename):
+        self.t.save_lookup_cache(filename.encode())
+
+    def load_lookup_cache(self, filename):
+        return self.t.load_lookup_cache(filename.encode())
+
+    def set_lookup_limits(self, max_epsilon_depth=10000, max_analyses=0):
+        self.t.set_lookup_limits(max_epsilon_depth, max_analyses)
+
+    def is_infinitely_ambiguous(self):
+        return self.t.is_infinitely_ambiguous()
@@ -3,8 +3,8 @@ from typing import List
 import os
 import pip._internal
 
-link_flags: List[str] = []
-compile_flags: List[str] = ['-Ofast', '-std=c++14']
+link_flags: List[str] = ['-pthread']
+compile_flags: List[str] = ['-Ofast', '-std=c++14', '-pthread']
 
 
 try:
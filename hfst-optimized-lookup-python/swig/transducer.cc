@@ -78,6 +78,7 @@ namespace hfst_ol {
                 HFST_THROW(TransducerHasWrongTypeException);
             }
         }
+        flag_operations = fd_table.pack_operations(symbol_count);
     }
 
     TransducerAlphabet::TransducerAlphabet(const SymbolTable &st)
@@ -90,6 +91,7 @@ namespace hfst_ol {
                 unknown_symbol = i;
             }
         }
+        flag_operations = fd_table.pack_operations(symbol_table.size());
     }
 
     StringSymbolMap TransducerAlphabet::build_string_symbol_map(void) const {
@@ -149,144 +151,368 @@ namespace hfst_ol {
         return weight.w;
     }
 
-    void OlLetterTrie::add_string(const char *p, SymbolNumber symbol_key) {
-        if (*(p + 1) == 0) {
-            symbols[(unsigned char)(*p)] = symbol_key;
-            return;
+    void OlLetterTrie::build(const SymbolTable &st, SymbolNumber symbol_count) {
+        // First an ordinary trie, with the children of each node by byte
+        std::vector<std::map<unsigned char, size_t> > children(1);
+        SymbolNumberVector node_symbols(1, NO_SYMBOL_NUMBER);
+        for (SymbolNumber k = 0; k < symbol_count; ++k) {
+            const unsigned char *p = (const unsigned char *)(st[k].c_str());
+            size_t node = 0;
+            for (; *p != 0; ++p) {
+                auto it = children[node].find(*p);
+                if (it == children[node].end()) {
+                    children[node][*p] = children.size();
+                    node = children.size();
+                    children.push_back(std::map<unsigned char, size_t>());
+                    node_symbols.push_back(NO_SYMBOL_NUMBER);
+                } else {
+                    node = it->second;
+                }
+            }
+            if (node != 0) { // epsilon is never read from the input
+                node_symbols[node] = k;
+            }
         }
-        if (letters[(unsigned char)(*p)] == NULL) {
-            letters[(unsigned char)(*p)] = new OlLetterTrie();
+
+        // Then place the nodes breadth first, the children of each at the
+        // lowest base where all their cells are free
+        const Cell free_cell = {0, -1, NO_SYMBOL_NUMBER};
+        cells.assign(1, free_cell);
+        std::vector<size_t> cell_of(children.size(), 0);
+        std::vector<size_t> queue(1, 0);
+        size_t first_free = 1;
+        for (size_t q = 0; q < queue.size(); ++q) {
+            size_t node = queue[q];
+            size_t cell = cell_of[node];
+            cells[cell].symbol = node_symbols[node];
+            if (children[node].empty()) {
+                continue;
+            }
+            unsigned char lowest = children[node].begin()->first;
+            unsigned char highest = children[node].rbegin()->first;
+            TransitionTableIndex base = first_free > lowest ? first_free - lowest : 0;
+            for (;; ++base) {
+                bool fits = true;
+                for (const auto &child : children[node]) {
+                    if (base + child.first < cells.size() &&
+                        cells[base + child.first].check != -1) {
+                        fits = false;
+                        break;
+                    }
+                }
+                if (fits) {
+                    break;
+                }
+            }
+            if (base + highest >= cells.size()) {
+                cells.resize(base + highest + 1, free_cell);
+            }
+            cells[cell].base = base;
+            for (const auto &child : children[node]) {
+                cells[base + child.first].check = (int)(cell);
+                cell_of[child.second] = base + child.first;
+                queue.push_back(child.second);
+            }
+            while (first_free < cells.size() && cells[first_free].check != -1) {
+                ++first_free;
+            }
         }
-        letters[(unsigned char)(*p)]->add_string(p + 1, symbol_key);
+        // Room for any byte after the last base, so that find_key() never
+        // has to check the size
+        cells.resize(cells.size() + UCHAR_MAX + 1, free_cell);
     }
 
-    SymbolNumber OlLetterTrie::find_key(char **p) {
-        const char *old_p = *p;
-        ++(*p);
-        if (letters[(unsigned char)(*old_p)] == NULL) {
-            return symbols[(unsigned char)(*old_p)];
-        }
-        SymbolNumber s = letters[(unsigned char)(*old_p)]->find_key(p);
-        if (s == NO_SYMBOL_NUMBER) {
-            --(*p);
-            return symbols[(unsigned char)(*old_p)];
+    SymbolNumber OlLetterTrie::find_key(char **p) const {
+        const unsigned char *s = (const unsigned char *)(*p);
+        SymbolNumber found = NO_SYMBOL_NUMBER;
+        const unsigned char *found_end = s;
+        int cell = 0;
+        for (; *s != 0; ++s) {
+            TransitionTableIndex next = cells[cell].base + *s;
+            if (cells[next].check != cell) {
+                break;
+            }
+            cell = next;
+            if (cells[cell].symbol != NO_SYMBOL_NUMBER) {
+                found = cells[cell].symbol;
+                found_end = s + 1;
+            }
         }
-        return s;
+        *p = (char *)(found_end);
+        return found;
     }
 
     void Encoder::read_input_symbols(const SymbolTable &kt) {
+        // the pairs that begin a longer symbol have to go through the trie
+        std::vector<bool> pair_extended(utf8_symbols.size(), false);
         for (SymbolNumber k = 0; k < number_of_input_symbols; ++k) {
             const char *p = kt[k].c_str();
-            if ((strlen(p) == 1) && should_ascii_tokenize((unsigned char)(*p))) {
+            const unsigned char *u = (const unsigned char *)(p);
+            size_t length = kt[k].size();
+            if ((length == 1) && should_ascii_tokenize((unsigned char)(*p))) {
                 ascii_symbols[(unsigned char)(*p)] = k;
             }
-            letters.add_string(p, k);
+            if (length >= 2 && is_utf8_pair(u)) {
+                if (length == 2) {
+                    utf8_symbols[utf8_pair_index(u)] = k;
+                } else {
+                    pair_extended[utf8_pair_index(u)] = true;
+                }
+            }
+        }
+        for (size_t i = 0; i < utf8_symbols.size(); ++i) {
+            if (pair_extended[i]) {
+                utf8_symbols[i] = NO_SYMBOL_NUMBER;
+            }
         }
+        letters.build(kt, number_of_input_symbols);
     }
 
-    SymbolNumber Encoder::find_key(char **p) {
-        if (ascii_symbols[(unsigned char)(**p)] == NO_SYMBOL_NUMBER) {
-            return letters.find_key(p);
+    SymbolNumber Encoder::find_key(char **p) const {
+        const unsigned char *s = (const unsigned char *)(*p);
+        SymbolNumber k = next_symbol(&s);
+        *p = (char *)(s);
+        return k;
+    }
+
+    inline SymbolNumber Encoder::next_symbol(const unsigned char **s) const {
+        SymbolNumber k = ascii_symbols[**s];
+        if (k != NO_SYMBOL_NUMBER) {
+            ++(*s);
+            return k;
         }
-        SymbolNumber s = ascii_symbols[(unsigned char)(**p)];
-        ++(*p);
-        return s;
+        if (is_utf8_pair(*s)) {
+            k = utf8_symbols[utf8_pair_index(*s)];
+            if (k != NO_SYMBOL_NUMBER) {
+                *s += 2;
+                return k;
+            }
+        }
+        char *p = (char *)(*s);
+        k = letters.find_key(&p);
+        *s = (const unsigned char *)(p);
+        return k;
     }
 
-    bool Transducer::initialize_input(const char *input_str) {
-        char *c = strdup(input_str);
-        char *c_orig = c;
-        int i = 0;
-        SymbolNumber k = NO_SYMBOL_NUMBER;
-        for (char **Str = &c; **Str != 0;) {
-            k = encoder->find_key(Str);
+    bool Encoder::encode(const char *str, size_t length, SymbolNumber *symbols) const {
+        const unsigned char *s = (const unsigned char *)(str);
+        const unsigned char *end = s + length;
+        while (s < end && *s != 0) {
+            SymbolNumber k = next_symbol(&s);
             if (k == NO_SYMBOL_NUMBER) {
-                free(c_orig);
-                return false; // tokenization failed
+                return false;
             }
-            input_tape[i] = k;
-            ++i;
+            *symbols = k;
+            ++symbols;
         }
-        input_tape[i] = NO_SYMBOL_NUMBER;
-        free(c_orig);
+        *symbols = NO_SYMBOL_NUMBER;
         return true;
     }
 
-    std::string remove_tags(const std::string &input, const std::regex &tags_regex) {
+    bool LookupContext::initialize_input(const char *input_str) {
+        size_t length = strlen(input_str);
+        // every symbol takes at least one byte of the input
+        if (input_tape.size() < length + 1) {
+            input_tape.resize(std::max(length + 1, 2 * input_tape.size()));
+        }
+        // room for as many epsilons as the default limit allows; analyze()
+        // makes more if a path needs it
+        size_t room = input_tape.size() +
+                      std::min<size_t>(limits.max_epsilon_depth, MAX_EPSILON_DEPTH);
+        if (output_tape.size() < room) {
+            output_tape.resize(room);
+        }
+        return model.get_encoder().encode(input_str, length, input_tape.data());
+    }
+
+    std::string remove_tags(const std::string &input) {
         // Sample input: @D.NEED@@P.NEED.REST@tuo<Pron><Dem><Sg><Par>@D.LOWERCASED@<cap>
         // Corresponding output: tuo
         // Apparently there are tags like @THIS@ and <this> which we should remove.
         // Also, compounds are sometimes marked with + and sometimes with +#
         // so just remove all occurrences of either character.
-        //const std::regex re ("@[^@]*@|<[^>]*>|[+#]|\\[[^\\]]*\\]");
-        return std::regex_replace(input, tags_regex, "");
+        // This does in one pass what replacing
+        //   @[^@]*@|<[^>]*>|[+#]|\[[^\]]*\]
+        // with "" does: an opening @, < or [ with no closing character after
+        // it is kept as it is.
+        std::string result;
+        result.reserve(input.size());
+        // once a closing character isn't found, it won't be found later either
+        bool unclosed_at = false, unclosed_angle = false, unclosed_bracket = false;
+        size_t i = 0;
+        while (i < input.size()) {
+            char c = input[i];
+            bool *unclosed = NULL;
+            char closing = 0;
+            switch (c) {
+                case '+':
+                case '#':
+                    ++i;
+                    continue;
+                case '@':
+                    unclosed = &unclosed_at;
+                    closing = '@';
+                    break;
+                case '<':
+                    unclosed = &unclosed_angle;
+                    closing = '>';
+                    break;
+                case '[':
+                    unclosed = &unclosed_bracket;
+                    closing = ']';
+                    break;
+                default:
+                    break;
+            }
+            if (unclosed != NULL && !*unclosed) {
+                size_t end = input.find(closing, i + 1);
+                if (end != std::string::npos) {
+                    i = end + 1;
+                    continue;
+                }
+                *unclosed = true;
+            }
+            result.push_back(c);
+            ++i;
+        }
+        return result;
     }
 
-    /*
-    std::vector<std::vector<std::string> > Transducer::multi_doc_lookup(const std::vector<std::string> &dokit)
-    {
-        boost::xpressive::sregex wordsplit = +boost::xpressive::_s;
-        // tokens:
-        std::vector<std::vector<std::string> > docs(dokit.size());
-
-        #pragma omp parallel for
-        for (uint32_t doc_seq = 0; doc_seq < docs.size(); ++doc_seq) {
-            const auto & raw_text = dokit[doc_seq];
-            boost::xpressive::sregex_token_iterator begin(raw_text.cbegin(), raw_text.cend(), wordsplit, -1), end;
-            docs[doc_seq].assign(begin, end);
+    // Call f(i) for each i below count, on threads that each take the
+    // next chunk of indexes not yet taken, so that none sits idle while
+    // another has a long queue. If a thread can't be started, those
+    // already running do its share; if f throws, no more chunks are taken
+    // and the first exception is rethrown once every thread has stopped.
+    template <class Function>
+    static void parallel_for(size_t count, size_t threads, size_t chunk, Function f) {
+        std::atomic<size_t> next(0);
+        std::exception_ptr failure;
+        std::mutex failure_lock;
+        auto work = [&]() {
+            try {
+                for (size_t begin = next.fetch_add(chunk); begin < count;
+                     begin = next.fetch_add(chunk)) {
+                    size_t end = std::min(begin + chunk, count);
+                    for (size_t i = begin; i < end; ++i) {
+                        f(i);
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failure_lock);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                next = count;
+            }
+        };
+        threads = std::min(threads, (count + chunk - 1) / chunk);
+        std::vector<std::thread> workers;
+        workers.reserve(threads);
+        for (size_t t = 1; t < threads; ++t) {
+            try {
+                workers.push_back(std::thread(work));
+            } catch (const std::system_error &) {
+                break;
+            }
+        }
+        work();
+        for (size_t t = 0; t < workers.size(); ++t) {
+            workers[t].join();
         }
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+    }
 
-        std::unordered_set<std::string> unseen_tokens;
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+               c == '\r';
+    }
 
-        // look up all unseen words
-        for (auto & doc : docs) {
-            for (auto & token :doc) {
-                if (!cached_results.count(token)) {
-                    unseen_tokens.insert(token);
-                }
+    static void split_on_whitespace(const std::string &text,
+                                    std::vector<std::string> &tokens) {
+        size_t i = 0;
+        while (i < text.size()) {
+            while (i < text.size() && is_space(text[i])) {
+                ++i;
+            }
+            size_t start = i;
+            while (i < text.size() && !is_space(text[i])) {
+                ++i;
+            }
+            if (i > start) {
+                tokens.push_back(text.substr(start, i - start));
             }
         }
+    }
 
-        for (auto &token : unseen_tokens) {
-            const auto lookup_result = this->lookup(token);
-            if (lookup_result.size()) {
-                // just pick one result:
-                const auto & last = lookup_result.back().first;
-                cached_results[token] = last;
-            } else {
-                // write not found tokens as-is:
-                cached_results[token] = token;
+    std::vector<std::vector<std::string> >
+    Transducer::multi_doc_lookup(const std::vector<std::string> &dokit, size_t threads) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        // tokens:
+        std::vector<std::vector<std::string> > docs(dokit.size());
+        parallel_for(docs.size(), threads, 1, [&](size_t doc_seq) {
+            split_on_whitespace(dokit[doc_seq], docs[doc_seq]);
+        });
+
+        // each distinct token once
+        std::unordered_map<std::string, std::string> analyses;
+        std::vector<const std::string *> tokens;
+        for (size_t doc_seq = 0; doc_seq < docs.size(); ++doc_seq) {
+            for (size_t token_seq = 0; token_seq < docs[doc_seq].size(); ++token_seq) {
+                auto added = analyses.insert(std::make_pair(docs[doc_seq][token_seq],
+                                                            std::string()));
+                if (added.second) {
+                    tokens.push_back(&added.first->first);
+                }
             }
         }
 
-        #pragma omp parallel for
-        for (uint32_t doc_seq = 0U; doc_seq < docs.size(); ++doc_seq) {
-            auto &doc = docs[doc_seq];
-            for (uint32_t token_seq = 0U; token_seq < doc.size(); ++token_seq) {
-                auto find_it = cached_results.find(doc[token_seq]);
-                if (find_it != cached_results.cend()) {
-                     doc[token_seq] = remove_tags(find_it->second, this->tags_regex);
-                } else if (doc[token_seq].length() < 2) {
-                    // remove all strings with size < 2:
-                    doc[token_seq] = "";
+        std::vector<std::string> results(tokens.size());
+        parallel_for(tokens.size(), threads, 64, [&](size_t token_seq) {
+            const std::string &token = *tokens[token_seq];
+            std::string &result = results[token_seq];
+            if (!saved_results.find(token, result) &&
+                !cached_results.find(token, result)) {
+                ContextPool::Lease context(contexts);
+                if (context->analyze(token.c_str()) != NULL) {
+                    // just pick one result:
+                    const LookupContext::Analysis &last = *context->last_analysis();
+                    result.assign(last.text, last.length);
+                    cached_results.insert(token, result);
+                } else {
+                    // write not found tokens as-is:
+                    result = token;
                 }
             }
+            result = remove_tags(result);
+        });
+        for (size_t token_seq = 0; token_seq < tokens.size(); ++token_seq) {
+            analyses[*tokens[token_seq]].swap(results[token_seq]);
         }
+
+        parallel_for(docs.size(), threads, 1, [&](size_t doc_seq) {
+            std::vector<std::string> &doc = docs[doc_seq];
+            for (size_t token_seq = 0; token_seq < doc.size(); ++token_seq) {
+                doc[token_seq] = analyses.find(doc[token_seq])->second;
+            }
+        });
         return docs;
     }
-    */
 
     std::vector<std::string> Transducer::multi_lookup(const StringVector &strs) {
         std::vector<std::string> result(strs.size());
+        ContextPool::Lease context(contexts);
         for (size_t it = 0; it < strs.size(); ++it) {
-            if (cached_results.count(strs[it])) {
-                result[it] = cached_results[strs[it]];
-            } else {
-                auto lookup_result = this->lookup(strs[it]);
-                if (lookup_result.size()) {
+            if (!saved_results.find(strs[it], result[it]) &&
+                !cached_results.find(strs[it], result[it])) {
+                if (context->analyze(strs[it].c_str()) != NULL) {
                     // just pick one result:
-                    result[it] = lookup_result.back().first;
-                    cached_results[strs[it]] = result[it];
+                    const LookupContext::Analysis &last = *context->last_analysis();
+                    result[it].assign(last.text, last.length);
+                    cached_results.insert(strs[it], result[it]);
                     // debug:
                     // std::cout<<result[it]<<std::endl;
                 } else {
@@ -299,7 +525,7 @@ namespace hfst_ol {
 
         #pragma omp parallel for
         for (size_t it = 0; it < result.size(); ++it) {
-            result[it] = remove_tags(result[it], this->tags_regex);
+            result[it] = remove_tags(result[it]);
         }
         // remove all empty strings:
         result.erase(std::remove_if(result.begin(), result.end(),
@@ -308,56 +534,378 @@ namespace hfst_ol {
         return result;
     }
 
+    void Transducer::set_lookup_limits(size_t max_epsilon_depth, size_t max_analyses) {
+        if (max_epsilon_depth > INT_MAX) {
+            throw std::invalid_argument("max_epsilon_depth is too large");
+        }
+        LookupLimits limits;
+        limits.max_epsilon_depth = max_epsilon_depth;
+        if (max_analyses > 0) {
+            limits.max_analyses = max_analyses;
+        }
+        context.set_limits(limits);
+        contexts.set_limits(limits);
+        cached_results.clear();
+    }
+
     void Transducer::write_lookup_cache() {
         FILE *fp = fopen("hfst_lookup_cache.ssv", "w");
-        for (auto it = cached_results.cbegin(); it != cached_results.cend(); ++it) {
-            fprintf(fp, "%s %s\n", it->first.c_str(), it->second.c_str());
-        }
+        cached_results.for_each([fp](const std::string &input, const std::string &result) {
+            fprintf(fp, "%s %s\n", input.c_str(), result.c_str());
+        });
         fclose(fp);
     }
 
+    void Transducer::save_lookup_cache(const std::string &filename) {
+        std::vector<std::pair<std::string, std::string> > entries;
+        std::unordered_set<std::string> cached;
+        cached_results.for_each([&](const std::string &input, const std::string &result) {
+            entries.push_back(std::make_pair(input, result));
+            cached.insert(input);
+        });
+        // and what was loaded but hasn't been looked up since
+        saved_results.for_each([&](const std::string &input, const std::string &result) {
+            if (!cached.count(input)) {
+                entries.push_back(std::make_pair(input, result));
+            }
+        });
+        MappedResultCache::write(filename, get_identity(), entries);
+    }
+
+    ContextPool::~ContextPool() {
+        for (size_t i = 0; i < idle.size(); ++i) {
+            delete idle[i];
+        }
+    }
+
+    LookupContext *ContextPool::acquire() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!idle.empty()) {
+                LookupContext *context = idle.back();
+                idle.pop_back();
+                context->set_limits(limits);
+                return context;
+            }
+        }
+        LookupContext *context = new LookupContext(model);
+        std::lock_guard<std::mutex> guard(lock);
+        context->set_limits(limits);
+        return context;
+    }
+
+    void ContextPool::set_limits(const LookupLimits &l) {
+        std::lock_guard<std::mutex> guard(lock);
+        limits = l;
+    }
+
+    void ContextPool::release(LookupContext *context) {
+        std::lock_guard<std::mutex> guard(lock);
+        idle.push_back(context);
+    }
+
+    const size_t ResultCache::SHARD_COUNT;
+
+    ResultCache::ResultCache(size_t max_bytes) :
+            shard_budget(max_bytes / SHARD_COUNT)
+    {}
+
+    bool ResultCache::find(const std::string &input, std::string &result) {
+        Shard &shard = shard_for(input);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto found = shard.index.find(&input);
+        if (found == shard.index.end()) {
+            ++shard.misses;
+            return false;
+        }
+        ++shard.hits;
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        result = found->second->second;
+        return true;
+    }
+
+    void ResultCache::insert(const std::string &input, const std::string &result) {
+        size_t bytes = entry_bytes(input, result);
+        if (bytes > shard_budget) {
+            return;
+        }
+        Shard &shard = shard_for(input);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto found = shard.index.find(&input);
+        if (found != shard.index.end()) {
+            // another thread looked it up too
+            return;
+        }
+        while (shard.bytes + bytes > shard_budget) {
+            auto &oldest = shard.entries.back();
+            shard.bytes -= entry_bytes(oldest.first, oldest.second);
+            shard.index.erase(&oldest.first);
+            shard.entries.pop_back();
+            ++shard.evictions;
+        }
+        shard.entries.emplace_front(input, result);
+        shard.index[&shard.entries.front().first] = shard.entries.begin();
+        shard.bytes += bytes;
+    }
+
+    void ResultCache::clear() {
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            shards[i].index.clear();
+            shards[i].entries.clear();
+            shards[i].bytes = 0;
+        }
+    }
+
+    CacheStats ResultCache::stats() const {
+        CacheStats total = {0, 0, 0, 0, 0};
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            total.hits += shards[i].hits;
+            total.misses += shards[i].misses;
+            total.evictions += shards[i].evictions;
+            total.entries += shards[i].entries.size();
+            total.bytes += shards[i].bytes;
+        }
+        return total;
+    }
+
+    const char MappedResultCache::MAGIC[8] = {'H', 'F', 'S', 'T', 'O', 'L', 'C', '\0'};
+    const uint32_t MappedResultCache::VERSION;
+    const uint32_t MappedResultCache::EMPTY_SLOT;
+
+    static uint64_t fnv1a_64(const char *p, size_t length,
+                             uint64_t hash = 14695981039346656037ULL) {
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ (unsigned char)(p[i])) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    uint64_t MappedResultCache::hash_input(const char *input, size_t length) {
+        return fnv1a_64(input, length);
+    }
+
+    bool MappedResultCache::map(const std::string &filename, uint64_t identity) {
+        unmap();
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat file_info;
+        if (fstat(fd, &file_info) != 0 ||
+            (size_t)(file_info.st_size) < sizeof(CacheFileHeader)) {
+            close(fd);
+            return false;
+        }
+        size_t size = file_info.st_size;
+        void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED) {
+            return false;
+        }
+        const CacheFileHeader *h = (const CacheFileHeader *)(m);
+        size_t slots_end = sizeof(CacheFileHeader) +
+                           (size_t)(h->slot_count) * sizeof(CacheFileSlot);
+        if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION ||
+            h->transducer_identity != identity || h->slot_count == 0 ||
+            (h->slot_count & (h->slot_count - 1)) != 0 ||
+            slots_end > size || size - slots_end != h->text_size) {
+            munmap(m, size);
+            return false;
+        }
+        const CacheFileSlot *s = (const CacheFileSlot *)((const char *)(m) + sizeof(CacheFileHeader));
+        for (size_t i = 0; i < h->slot_count; ++i) {
+            if (s[i].input_offset == EMPTY_SLOT) {
+                continue;
+            }
+            // every entry has to lie within the text, whatever the file says
+            if ((uint64_t)(s[i].input_offset) + s[i].input_length > h->text_size ||
+                (uint64_t)(s[i].result_offset) + s[i].result_length > h->text_size) {
+                munmap(m, size);
+                return false;
+            }
+        }
+        mapping = m;
+        mapping_size = size;
+        header = h;
+        slots = s;
+        text = (const char *)(m) + slots_end;
+        return true;
+    }
+
+    void MappedResultCache::unmap() {
+        if (mapping != NULL) {
+            munmap(mapping, mapping_size);
+        }
+        mapping = NULL;
+        mapping_size = 0;
+        header = NULL;
+        slots = NULL;
+        text = NULL;
+    }
+
+    bool MappedResultCache::find(const std::string &input, std::string &result) const {
+        if (header == NULL) {
+            return false;
+        }
+        uint64_t hash = hash_input(input.data(), input.size());
+        size_t mask = header->slot_count - 1;
+        size_t i = hash & mask;
+        for (size_t probes = 0; probes < header->slot_count; ++probes) {
+            const CacheFileSlot &slot = slots[i];
+            if (slot.input_offset == EMPTY_SLOT) {
+                return false;
+            }
+            if (slot.hash == hash && slot.input_length == input.size() &&
+                memcmp(text + slot.input_offset, input.data(), input.size()) == 0) {
+                result.assign(text + slot.result_offset, slot.result_length);
+                return true;
+            }
+            i = (i + 1) & mask;
+        }
+        return false;
+    }
+
+    void MappedResultCache::write(const std::string &filename, uint64_t identity,
+                                  const std::vector<std::pair<std::string, std::string> > &entries) {
+        // at most half full, so that a search always ends at an empty slot
+        uint32_t slot_count = 1;
+        while (slot_count < 2 * entries.size()) {
+            slot_count *= 2;
+        }
+        const CacheFileSlot empty = {0, EMPTY_SLOT, 0, 0, 0};
+        std::vector<CacheFileSlot> slot_table(slot_count, empty);
+        std::string text;
+        CacheFileHeader header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.slot_count = slot_count;
+        header.transducer_identity = identity;
+        header.entry_count = 0;
+        for (size_t e = 0; e < entries.size(); ++e) {
+            const std::string &input = entries[e].first;
+            const std::string &result = entries[e].second;
+            if (text.size() + input.size() + result.size() >= EMPTY_SLOT) {
+                break; // offsets are 32 bits
+            }
+            uint64_t hash = hash_input(input.data(), input.size());
+            size_t i = hash & (slot_count - 1);
+            while (slot_table[i].input_offset != EMPTY_SLOT) {
+                i = (i + 1) & (slot_count - 1);
+            }
+            slot_table[i].hash = hash;
+            slot_table[i].input_offset = text.size();
+            slot_table[i].input_length = input.size();
+            text.append(input);
+            slot_table[i].result_offset = text.size();
+            slot_table[i].result_length = result.size();
+            text.append(result);
+            ++header.entry_count;
+        }
+        header.text_size = text.size();
+
+        std::string temporary = filename + ".tmp";
+        std::ofstream os(temporary.c_str(), std::ofstream::binary);
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char *>(slot_table.data()),
+                 slot_table.size() * sizeof(CacheFileSlot));
+        os.write(text.data(), text.size());
+        os.close();
+        if (!os || rename(temporary.c_str(), filename.c_str()) != 0) {
+            remove(temporary.c_str());
+            HFST_THROW_MESSAGE(StreamCannotBeWrittenException, filename);
+        }
+    }
+
     std::vector<std::pair<std::string, Weight> >
-    Transducer::lookup(const std::string &s) {
+    LookupContext::lookup(const std::string &s) {
         return lookup(s.c_str());
     }
 
-    std::vector<std::pair<std::string, Weight> > Transducer::lookup(const char *s) {
-        lookup_results.clear();
+    std::vector<std::pair<std::string, Weight> > LookupContext::lookup(const char *s) {
+        std::vector<std::pair<std::string, Weight> > results;
+        for (const Analysis *a = analyze(s); a != NULL; a = a->next) {
+            results.push_back(std::pair<std::string, Weight>(
+                    std::string(a->text, a->length), a->weight));
+        }
+        return results;
+    }
+
+    const LookupContext::Analysis *LookupContext::analyze(const char *s) {
         if (!initialize_input(s)) {
-            return lookup_results;
+            arena.reset();
+            first_analysis = NULL;
+            last_found = NULL;
+            analysis_count = 0;
+            return NULL;
+        }
+        // no path can be longer than this
+        size_t longest = limits.max_epsilon_depth < SIZE_MAX - input_tape.size() ?
+                         input_tape.size() + limits.max_epsilon_depth : SIZE_MAX;
+        while (true) {
+            arena.reset();
+            first_analysis = NULL;
+            last_found = NULL;
+            analysis_count = 0;
+            output_tape_full = false;
+            // current_weight += s.second;
+            visit(input_tape.data(), output_tape.data(), output_tape.data(), 0);
+            // current_weight -= s.second;
+            if (!output_tape_full) {
+                return first_analysis;
+            }
+            // the tapes are pointed into all along a path, so the lookup
+            // is started over on a longer output tape
+            output_tape.resize(std::min(longest, 2 * output_tape.size()));
         }
-        // current_weight += s.second;
-        get_analyses(input_tape, output_tape, output_tape, 0);
-        // current_weight -= s.second;
-        return std::vector<std::pair<std::string, Weight> >(lookup_results);
     }
 
-    void Transducer::try_epsilon_transitions(SymbolNumber *input_symbol,
-                                             SymbolNumber *output_symbol,
-                                             SymbolNumber *original_output_tape,
-                                             TransitionTableIndex i) {
+    void LookupContext::try_epsilon_transitions(SymbolNumber *input_symbol,
+                                                SymbolNumber *output_symbol,
+                                                SymbolNumber *original_output_tape,
+                                                TransitionTableIndex i) {
         //        std::cerr << "try_epsilon_transitions, index " << i << std::endl;
+        // Every other transition on the path so far consumed an input symbol
+        if (static_cast<size_t>((output_symbol - output_tape.data()) -
+                                (input_symbol - input_tape.data())) >=
+            limits.max_epsilon_depth) {
+            return;
+        }
         while (true) {
-            if (tables->get_transition_input(i) == 0) // epsilon
+            if (tables.get_transition_input(i) == 0) // epsilon
             {
-                *output_symbol = tables->get_transition_output(i);
-                current_weight += tables->get_weight(i);
-                get_analyses(input_symbol, output_symbol + 1, original_output_tape,
-                             tables->get_transition_target(i));
-                current_weight -= tables->get_weight(i);
+                if (!check_cycles ||
+                    !revisits(tables.get_transition_target(i), input_symbol)) {
+                    *output_symbol = tables.get_transition_output(i);
+                    current_weight += tables.get_weight(i);
+                    visit(input_symbol, output_symbol + 1, original_output_tape,
+                          tables.get_transition_target(i));
+                    current_weight -= tables.get_weight(i);
+                }
                 ++i;
-            } else if (alphabet->is_flag_diacritic(tables->get_transition_input(i))) {
-                std::vector<short> old_values(flag_state.get_values());
-                if (flag_state.apply_operation(
-                        *(alphabet->get_operation(tables->get_transition_input(i))))) {
+            } else if (alphabet.is_flag_diacritic(tables.get_transition_input(i))) {
+                const hfst::FdPackedOperation &op =
+                        alphabet.get_flag_operation(tables.get_transition_input(i));
+                hfst::FdValue old_value = flag_state.get_value(op.Feature());
+                if (flag_state.apply_operation(op)) {
                     // flag diacritic allowed
-                    *output_symbol = tables->get_transition_output(i);
-                    current_weight += tables->get_weight(i);
-                    get_analyses(input_symbol, output_symbol + 1, original_output_tape,
-                                 tables->get_transition_target(i));
-                    current_weight -= tables->get_weight(i);
+                    if (check_cycles) {
+                        flag_log.push_back(std::make_pair(op.Feature(), old_value));
+                    }
+                    if (!check_cycles ||
+                        !revisits(tables.get_transition_target(i), input_symbol)) {
+                        *output_symbol = tables.get_transition_output(i);
+                        current_weight += tables.get_weight(i);
+                        visit(input_symbol, output_symbol + 1, original_output_tape,
+                              tables.get_transition_target(i));
+                        current_weight -= tables.get_weight(i);
+                    }
+                    if (check_cycles) {
+                        flag_log.pop_back();
+                    }
                 }
-                flag_state.assign_values(old_values);
+                flag_state.set_value(op.Feature(), old_value);
                 ++i;
             } else { // it's not epsilon and it's not a flag, so nothing to do
                 return;
@@ -365,32 +913,32 @@ namespace hfst_ol {
         }
     }
 
-    void Transducer::try_epsilon_indices(SymbolNumber *input_symbol,
-                                         SymbolNumber *output_symbol,
-                                         SymbolNumber *original_output_tape,
-                                         TransitionTableIndex i) {
+    void LookupContext::try_epsilon_indices(SymbolNumber *input_symbol,
+                                            SymbolNumber *output_symbol,
+                                            SymbolNumber *original_output_tape,
+                                            TransitionTableIndex i) {
         //    std::cerr << "try_epsilon_indices, index " << i << std::endl;
-        if (tables->get_index_input(i) == 0) {
+        if (tables.get_index_input(i) == 0) {
             try_epsilon_transitions(input_symbol, output_symbol, original_output_tape,
-                                    tables->get_index_target(i) -
+                                    tables.get_index_target(i) -
                                     TRANSITION_TARGET_TABLE_START);
         }
     }
 
-    void Transducer::find_transitions(SymbolNumber input,
-                                      SymbolNumber *input_symbol,
-                                      SymbolNumber *output_symbol,
-                                      SymbolNumber *original_output_tape,
-                                      TransitionTableIndex i) {
+    void LookupContext::find_transitions(SymbolNumber input,
+                                         SymbolNumber *input_symbol,
+                                         SymbolNumber *output_symbol,
+                                         SymbolNumber *original_output_tape,
+                                         TransitionTableIndex i) {
 
-        while (tables->get_transition_input(i) != NO_SYMBOL_NUMBER) {
-            if (tables->get_transition_input(i) == input) {
+        while (tables.get_transition_input(i) != NO_SYMBOL_NUMBER) {
+            if (tables.get_transition_input(i) == input) {
 
-                *output_symbol = tables->get_transition_output(i);
-                current_weight += tables->get_weight(i);
-                get_analyses(input_symbol, output_symbol + 1, original_output_tape,
-                             tables->get_transition_target(i));
-                current_weight -= tables->get_weight(i);
+                *output_symbol = tables.get_transition_output(i);
+                current_weight += tables.get_weight(i);
+                visit(input_symbol, output_symbol + 1, original_output_tape,
+                      tables.get_transition_target(i));
+                current_weight -= tables.get_weight(i);
             } else {
                 return;
             }
@@ -398,21 +946,28 @@ namespace hfst_ol {
         }
     }
 
-    void Transducer::find_index(SymbolNumber input, SymbolNumber *input_symbol,
-                                SymbolNumber *output_symbol,
-                                SymbolNumber *original_output_tape,
-                                TransitionTableIndex i) {
-        if (tables->get_index_input(i + input) == input) {
+    void LookupContext::find_index(SymbolNumber input, SymbolNumber *input_symbol,
+                                   SymbolNumber *output_symbol,
+                                   SymbolNumber *original_output_tape,
+                                   TransitionTableIndex i) {
+        if (tables.get_index_input(i + input) == input) {
             find_transitions(input, input_symbol, output_symbol, original_output_tape,
-                             tables->get_index_target(i + input) -
+                             tables.get_index_target(i + input) -
                              TRANSITION_TARGET_TABLE_START);
         }
     }
 
-    void Transducer::get_analyses(SymbolNumber *input_symbol,
-                                  SymbolNumber *output_symbol,
-                                  SymbolNumber *original_output_tape,
-                                  TransitionTableIndex i) {
+    void LookupContext::get_analyses(SymbolNumber *input_symbol,
+                                     SymbolNumber *output_symbol,
+                                     SymbolNumber *original_output_tape,
+                                     TransitionTableIndex i) {
+        if (analysis_count == limits.max_analyses || output_tape_full) {
+            return;
+        }
+        if (output_symbol == output_tape.data() + output_tape.size()) {
+            output_tape_full = true;
+            return;
+        }
         if (indexes_transition_table(i)) {
             i -= TRANSITION_TARGET_TABLE_START;
 
@@ -422,10 +977,10 @@ namespace hfst_ol {
             // input-string ended.
             if (*input_symbol == NO_SYMBOL_NUMBER) {
                 *output_symbol = NO_SYMBOL_NUMBER;
-                if (tables->get_transition_finality(i)) {
-                    current_weight += tables->get_weight(i);
+                if (tables.get_transition_finality(i)) {
+                    current_weight += tables.get_weight(i);
                     note_analysis(original_output_tape);
-                    current_weight -= tables->get_weight(i);
+                    current_weight -= tables.get_weight(i);
                 }
                 return;
             }
@@ -441,10 +996,10 @@ namespace hfst_ol {
 
             if (*input_symbol == NO_SYMBOL_NUMBER) { // input-string ended.
                 *output_symbol = NO_SYMBOL_NUMBER;
-                if (tables->get_index_finality(i)) {
-                    current_weight += tables->get_final_weight(i);
+                if (tables.get_index_finality(i)) {
+                    current_weight += tables.get_final_weight(i);
                     note_analysis(original_output_tape);
-                    current_weight -= tables->get_final_weight(i);
+                    current_weight -= tables.get_final_weight(i);
                 }
                 return;
             }
@@ -457,45 +1012,203 @@ namespace hfst_ol {
         *output_symbol = NO_SYMBOL_NUMBER;
     }
 
-    void Transducer::note_analysis(SymbolNumber *whole_output_tape) {
-        std::string result;
+    void LookupContext::note_analysis(SymbolNumber *whole_output_tape) {
+        if (analysis_count == limits.max_analyses) {
+            return;
+        }
+        ++analysis_count;
+        size_t length = 0;
+        for (SymbolNumber *num = whole_output_tape; *num != NO_SYMBOL_NUMBER; ++num) {
+            length += alphabet.string_from_symbol(*num).size();
+        }
+        char *text = arena.allocate<char>(length + 1);
+        char *end = text;
         for (SymbolNumber *num = whole_output_tape; *num != NO_SYMBOL_NUMBER; ++num) {
-            result.append(alphabet->string_from_symbol(*num));
+            const std::string &symbol = alphabet.string_from_symbol(*num);
+            memcpy(end, symbol.data(), symbol.size());
+            end += symbol.size();
+        }
+        *end = '\0';
+
+        Analysis *analysis = arena.allocate<Analysis>();
+        analysis->text = text;
+        analysis->length = length;
+        analysis->weight = current_weight;
+        analysis->next = NULL;
+        if (last_found == NULL) {
+            first_analysis = analysis;
+        } else {
+            last_found->next = analysis;
+        }
+        last_found = analysis;
+    }
+
+    const size_t LookupArena::FIRST_BLOCK_SIZE;
+
+    LookupArena::~LookupArena() {
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            free(blocks[i].data);
+        }
+    }
+
+    void *LookupArena::allocate(size_t size, size_t alignment) {
+        if (!blocks.empty()) {
+            size_t start = (used + alignment - 1) & ~(alignment - 1);
+            if (start + size <= blocks.back().size) {
+                used = start + size;
+                return blocks.back().data + start;
+            }
+            total_used += used;
+        }
+        // a new block, at least twice as big as the last; malloc aligns it
+        // for anything
+        Block block;
+        block.size = std::max(blocks.empty() ? FIRST_BLOCK_SIZE : 2 * blocks.back().size,
+                              size);
+        block.data = static_cast<char *>(malloc(block.size));
+        if (block.data == NULL) {
+            throw std::bad_alloc();
+        }
+        blocks.push_back(block);
+        used = size;
+        return block.data;
+    }
+
+    void LookupArena::reset() {
+        if (blocks.size() > 1) {
+            // one block big enough for all of it next time
+            size_t size = blocks.back().size;
+            size_t needed = total_used + used;
+            while (size < needed) {
+                size *= 2;
+            }
+            for (size_t i = 0; i < blocks.size(); ++i) {
+                free(blocks[i].data);
+            }
+            blocks.clear();
+            Block block;
+            block.size = size;
+            block.data = static_cast<char *>(malloc(size));
+            if (block.data == NULL) {
+                throw std::bad_alloc();
+            }
+            blocks.push_back(block);
         }
-        lookup_results.push_back(
-                std::pair<std::string, Weight>(result, current_weight));
+        used = 0;
+        total_used = 0;
     }
 
-    Transducer::Transducer(const std::string &filename) :
-            cached_results(256000)
-    {
+    // Keeps a hash and a count of the bytes written through it
+    class HashingBuffer : public std::streambuf {
+    public:
+        uint64_t hash;
+        uint64_t size;
+
+        HashingBuffer() : hash(fnv1a_64(NULL, 0)), size(0) {}
+
+    protected:
+        std::streamsize xsputn(const char *p, std::streamsize n) {
+            hash = fnv1a_64(p, n, hash);
+            size += n;
+            return n;
+        }
+        int overflow(int c) {
+            if (c != EOF) {
+                char ch = (char)(c);
+                xsputn(&ch, 1);
+            }
+            return c;
+        }
+    };
+
+    uint64_t TransducerModel::get_identity(void) const {
+        // only a cache needs it, so it's hashed from the loaded model on
+        // first use rather than at load time
+        std::call_once(identity_computed, [this]() {
+            HashingBuffer buffer;
+            std::ostream os(&buffer);
+            write(os);
+            identity = buffer.hash ^ (buffer.size * 1099511628211ULL);
+        });
+        return identity;
+    }
+
+    TransducerModel::TransducerModel(const std::string &filename) {
         std::ifstream is(filename.c_str(), std::ifstream::in);
         // the other constructors throw exceptions if data can't be read at some point
         skip_hfst3_header(is);
         header = new TransducerHeader(is);
         alphabet = new TransducerAlphabet(is, header->symbol_count());
         tables = NULL;
-        current_weight = 0.0;
         encoder =
                 new Encoder(alphabet->get_symbol_table(), header->input_symbol_count());
-        input_tape = (SymbolNumber *)(malloc(sizeof(SymbolNumber) * MAX_IO_LEN));
-        output_tape = (SymbolNumber *)(malloc(sizeof(SymbolNumber) * MAX_IO_LEN));
-        flag_state = alphabet->get_fd_table();
         load_tables(is);
         is.close();
-        tags_regex = std::regex("@[^@]*@|<[^>]*>|[+#]|\\[[^\\]]*\\]");
     }
 
-    Transducer::~Transducer() {
+    TransducerModel::~TransducerModel() {
         delete header;
         delete alphabet;
         delete tables;
         delete encoder;
-        free(input_tape);
-        free(output_tape);
     }
 
-    void Transducer::load_tables(std::istream &is) {
+    LookupContext::LookupContext(const TransducerModel &m) :
+            model(m),
+            tables(m.get_tables()),
+            alphabet(m.get_alphabet()),
+            current_weight(0.0),
+            arena(),
+            first_analysis(NULL),
+            last_found(NULL),
+            analysis_count(0),
+            limits(),
+            input_tape(1000),
+            output_tape(1000 + MAX_EPSILON_DEPTH),
+            output_tape_full(false),
+            flag_state(m.get_fd_table()),
+            check_cycles(m.is_infinitely_ambiguous()),
+            path(),
+            flag_log()
+    {}
+
+    bool LookupContext::revisits(TransitionTableIndex state,
+                                 const SymbolNumber *input_symbol) const {
+        // the steps at the same input position are the last ones
+        for (size_t k = path.size(); k > 0 && path[k - 1].input_symbol == input_symbol;
+             --k) {
+            if (path[k - 1].state == state && flags_unchanged_since(path[k - 1].flag_mark)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool LookupContext::flags_unchanged_since(size_t mark) const {
+        // each feature changed since is compared with the value it had first
+        for (size_t i = mark; i < flag_log.size(); ++i) {
+            bool changed_before = false;
+            for (size_t j = mark; j < i && !changed_before; ++j) {
+                changed_before = flag_log[j].first == flag_log[i].first;
+            }
+            if (!changed_before &&
+                flag_state.get_value(flag_log[i].first) != flag_log[i].second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    LookupContext::~LookupContext() {}
+
+    Transducer::Transducer(const std::string &filename, size_t cache_bytes) :
+            TransducerModel(filename),
+            context(*this),
+            contexts(*this),
+            cached_results(cache_bytes)
+    {}
+
+    void TransducerModel::load_tables(std::istream &is) {
         if (header->probe_flag(Weighted))
             tables = new TransducerTables<TransitionWIndex, TransitionW>(
                     is, header->index_table_size(), header->target_table_size());
@@ -507,7 +1220,7 @@ namespace hfst_ol {
         }
     }
 
-    void Transducer::write(std::ostream &os) const {
+    void TransducerModel::write(std::ostream &os) const {
         header->write(os);
         alphabet->write(os);
         for (size_t i = 0; i < header->index_table_size(); i++)
@@ -516,7 +1229,7 @@ namespace hfst_ol {
             tables->get_transition(i).write(os, header->probe_flag(Weighted));
     }
 
-    void Transducer::display() const {
+    void TransducerModel::display() const {
         std::cout << "-----Displaying optimized-lookup transducer------" << std::endl;
         header->display();
         alphabet->display();
@@ -525,7 +1238,7 @@ namespace hfst_ol {
     }
 
     TransitionTableIndexSet
-    Transducer::get_transitions_from_state(TransitionTableIndex state_index) const {
+    TransducerModel::get_transitions_from_state(TransitionTableIndex state_index) const {
         TransitionTableIndexSet transitions;
 
         if (indexes_transition_index_table(state_index)) {
@@ -592,8 +1305,8 @@ namespace hfst_ol {
         return transitions;
     }
 
-    TransitionTableIndex Transducer::next(const TransitionTableIndex i,
-                                          const SymbolNumber symbol) const {
+    TransitionTableIndex TransducerModel::next(const TransitionTableIndex i,
+                                               const SymbolNumber symbol) const {
         if (i >= TRANSITION_TARGET_TABLE_START) {
             return i - TRANSITION_TARGET_TABLE_START + 1;
         } else {
@@ -602,8 +1315,8 @@ namespace hfst_ol {
         }
     }
 
-    bool Transducer::has_transitions(const TransitionTableIndex i,
-                                     const SymbolNumber symbol) const {
+    bool TransducerModel::has_transitions(const TransitionTableIndex i,
+                                          const SymbolNumber symbol) const {
         if (i >= TRANSITION_TARGET_TABLE_START) {
             return (
                     get_transition(i - TRANSITION_TARGET_TABLE_START).get_input_symbol() ==
@@ -613,7 +1326,7 @@ namespace hfst_ol {
         }
     }
 
-    bool Transducer::has_epsilons_or_flags(const TransitionTableIndex i) {
+    bool TransducerModel::has_epsilons_or_flags(const TransitionTableIndex i) const {
         if (i >= TRANSITION_TARGET_TABLE_START) {
             return (
                     get_transition(i - TRANSITION_TARGET_TABLE_START).get_input_symbol() ==
@@ -625,7 +1338,7 @@ namespace hfst_ol {
         }
     }
 
-    STransition Transducer::take_epsilons(const TransitionTableIndex i) const {
+    STransition TransducerModel::take_epsilons(const TransitionTableIndex i) const {
         if (get_transition(i).get_input_symbol() != 0) {
             return STransition(0, NO_SYMBOL_NUMBER);
         }
@@ -634,7 +1347,7 @@ namespace hfst_ol {
                            get_transition(i).get_weight());
     }
 
-    STransition Transducer::take_epsilons_and_flags(const TransitionTableIndex i) {
+    STransition TransducerModel::take_epsilons_and_flags(const TransitionTableIndex i) const {
         if (get_transition(i).get_input_symbol() != 0 &&
             !is_flag(get_transition(i).get_input_symbol())) {
             return STransition(0, NO_SYMBOL_NUMBER);
@@ -644,8 +1357,8 @@ namespace hfst_ol {
                            get_transition(i).get_weight());
     }
 
-    STransition Transducer::take_non_epsilons(const TransitionTableIndex i,
-                                              const SymbolNumber symbol) const {
+    STransition TransducerModel::take_non_epsilons(const TransitionTableIndex i,
+                                                   const SymbolNumber symbol) const {
         if (get_transition(i).get_input_symbol() != symbol) {
             return STransition(0, NO_SYMBOL_NUMBER);
         }
@@ -654,7 +1367,7 @@ namespace hfst_ol {
                            get_transition(i).get_weight());
     }
 
-    Weight Transducer::final_weight(const TransitionTableIndex i) const {
+    Weight TransducerModel::final_weight(const TransitionTableIndex i) const {
         if (i >= TRANSITION_TARGET_TABLE_START) {
             return get_transition(i - TRANSITION_TARGET_TABLE_START).get_weight();
         } else {
@@ -18,20 +18,32 @@
 #include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <new>
 #include <queue>
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
-#include <regex>
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <thread>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "HfstExceptionDefs.h"
 #include "HfstFlagDiacritics.h"
@@ -85,7 +97,9 @@ namespace hfst_ol {
 // This is 2^31, hopefully equal to UINT_MAX/2 rounded up.
 // For some profound reason it can't be replaced with (UINT_MAX+1)/2.
     const TransitionTableIndex TRANSITION_TARGET_TABLE_START = 2147483648u;
-    const unsigned int MAX_IO_LEN = 10000;
+    // How many epsilons and flag diacritics a lookup path may take, unless
+    // LookupLimits say otherwise
+    const unsigned int MAX_EPSILON_DEPTH = 10000;
 
 // This function is queried to check whether we should do the
 // single-character ascii lookup tokenization or the regular
@@ -279,6 +293,8 @@ namespace hfst_ol {
     protected:
         SymbolTable symbol_table;
         hfst::FdTable<SymbolNumber> fd_table;
+        // fd_table's operations indexed by symbol, for lookup
+        std::vector<hfst::FdPackedOperation> flag_operations;
         SymbolNumber unknown_symbol;
 
     public:
@@ -301,14 +317,20 @@ namespace hfst_ol {
 
         bool has_flag_diacritics() const { return fd_table.num_features() > 0; }
         bool is_flag_diacritic(SymbolNumber symbol) const {
-          return fd_table.is_diacritic(symbol);
+          return symbol < flag_operations.size() &&
+                 flag_operations[symbol].is_diacritic();
+        }
+        // symbol must be a flag diacritic
+        const hfst::FdPackedOperation &get_flag_operation(SymbolNumber symbol) const {
+          return flag_operations[symbol];
         }
 
         const SymbolTable &get_symbol_table() const { return symbol_table; }
-        const std::string string_from_symbol(const SymbolNumber symbol) const
+        const std::string &string_from_symbol(const SymbolNumber symbol) const
         // represent epsilon as blank string
         {
-          return (symbol == 0) ? "" : symbol_table[symbol];
+          static const std::string epsilon;
+          return (symbol == 0) ? epsilon : symbol_table[symbol];
         }
         StringSymbolMap build_string_symbol_map(void) const;
         const hfst::FdTable<SymbolNumber> &get_fd_table() const { return fd_table; }
@@ -615,22 +637,29 @@ namespace hfst_ol {
 
 // There follow some classes for implementing lookup
 
-    class OlLetterTrie;
-    typedef std::vector<OlLetterTrie *> OlLetterTrieVector;
-
+    // The input symbols as a double-array trie. The node in cell s has its
+    // child on byte c in cell base + c, which is its child only if the
+    // check of that cell is s. It is built once from the whole alphabet and
+    // matched with a loop over one array.
     class OlLetterTrie {
     private:
-        OlLetterTrieVector letters;
-        SymbolNumberVector symbols;
+        struct Cell {
+            TransitionTableIndex base;
+            int check; // the parent cell, -1 if none
+            SymbolNumber symbol; // that ends here, if any
+        };
+
+        std::vector<Cell> cells;
 
     public:
-        OlLetterTrie(void)
-                : letters(UCHAR_MAX, static_cast<OlLetterTrie *>(NULL)),
-                  symbols(UCHAR_MAX, NO_SYMBOL_NUMBER) {}
+        OlLetterTrie(void) : cells(1, Cell{0, -1, NO_SYMBOL_NUMBER}) {}
 
-        void add_string(const char *p, SymbolNumber symbol_key);
+        // Build the trie of the symbols, each numbered by its place in st.
+        // Of equal strings the last one wins.
+        void build(const SymbolTable &st, SymbolNumber symbol_count);
 
-        SymbolNumber find_key(char **p);
+        // The longest symbol at *p, which is moved past it, or NO_SYMBOL_NUMBER
+        SymbolNumber find_key(char **p) const;
     };
 
     class Encoder {
@@ -639,71 +668,70 @@ namespace hfst_ol {
         SymbolNumber number_of_input_symbols;
         OlLetterTrie letters;
         SymbolNumberVector ascii_symbols;
+        // Two-byte UTF-8 characters (such as all of Latin-1) that are symbols
+        // and no longer symbol starts with, by the low bits of both bytes
+        SymbolNumberVector utf8_symbols;
 
         void read_input_symbols(const SymbolTable &kt);
 
+        static bool is_utf8_pair(const unsigned char *p) {
+            return p[0] >= 0xc2 && p[0] <= 0xdf && (p[1] & 0xc0) == 0x80;
+        }
+
+        static size_t utf8_pair_index(const unsigned char *p) {
+            return ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+        }
+
+        // The next symbol at *s, moving *s past it
+        SymbolNumber next_symbol(const unsigned char **s) const;
+
     public:
         Encoder(const SymbolTable &st, SymbolNumber input_symbol_count)
                 : number_of_input_symbols(input_symbol_count),
-                  ascii_symbols(UCHAR_MAX, NO_SYMBOL_NUMBER) {
+                  ascii_symbols(UCHAR_MAX + 1, NO_SYMBOL_NUMBER),
+                  utf8_symbols(1 << 11, NO_SYMBOL_NUMBER) {
           read_input_symbols(st);
         }
 
-        SymbolNumber find_key(char **p);
+        SymbolNumber find_key(char **p) const;
+
+        // Tokenize the length bytes of str into symbols, ending them with
+        // NO_SYMBOL_NUMBER. Returns false if some of it isn't any symbol.
+        bool encode(const char *str, size_t length, SymbolNumber *symbols) const;
     };
 
-    class Transducer {
+    // Everything read from a transducer file. Lookup never changes any of
+    // it, so one model can be shared by any number of LookupContexts, each
+    // looking up in a thread of its own, without locks.
+    class TransducerModel {
     protected:
         TransducerHeader *header;
         TransducerAlphabet *alphabet;
-        std::regex tags_regex;
 
         TransducerTablesInterface *tables;
-
-        void load_tables(std::istream &is);
-
-        // for lookup
-        Weight current_weight;
-        ResultVector lookup_results;
         Encoder *encoder;
-        SymbolNumber *input_tape;
-        SymbolNumber *output_tape;
-        hfst::FdState<SymbolNumber> flag_state;
-        std::unordered_map<std::string, std::string> cached_results;
+        mutable std::once_flag identity_computed;
+        mutable uint64_t identity;
 
-        void try_epsilon_transitions(SymbolNumber *input_symbol,
-                                     SymbolNumber *output_symbol,
-                                     SymbolNumber *original_output_tape,
-                                     TransitionTableIndex i);
-
-        void try_epsilon_indices(SymbolNumber *input_symbol,
-                                 SymbolNumber *output_symbol,
-                                 SymbolNumber *original_output_tape,
-                                 TransitionTableIndex i);
-
-        void find_transitions(SymbolNumber input, SymbolNumber *input_symbol,
-                              SymbolNumber *output_symbol,
-                              SymbolNumber *original_output_tape,
-                              TransitionTableIndex i);
-
-        void find_index(SymbolNumber input, SymbolNumber *input_symbol,
-                        SymbolNumber *output_symbol,
-                        SymbolNumber *original_output_tape, TransitionTableIndex i);
+        void load_tables(std::istream &is);
 
-        void get_analyses(SymbolNumber *input_symbol, SymbolNumber *output_symbol,
-                          SymbolNumber *original_output_tape, TransitionTableIndex i);
+    private:
+        TransducerModel(const TransducerModel &);
+        TransducerModel &operator=(const TransducerModel &);
 
     public:
-        Transducer(const std::string &filename);
-        virtual ~Transducer();
+        TransducerModel(const std::string &filename);
+        virtual ~TransducerModel();
 
         void write(std::ostream &os) const;
         void display() const;
-        void write_lookup_cache();
 
         const TransducerHeader &get_header() const { return *header; }
         const TransducerAlphabet &get_alphabet() const { return *alphabet; }
         const Encoder &get_encoder(void) const { return *encoder; }
+        const TransducerTablesInterface &get_tables(void) const { return *tables; }
+        // A hash of the transducer, to tell which one a cache is for
+        uint64_t get_identity(void) const;
         const hfst::FdTable<SymbolNumber> &get_fd_table() const {
           return alphabet->get_fd_table();
         }
@@ -725,7 +753,8 @@ namespace hfst_ol {
           }
         }
         bool is_infinitely_ambiguous(void) const {
-          return header->probe_flag(Has_input_epsilon_cycles);
+          return header->probe_flag(Has_input_epsilon_cycles) ||
+                 header->probe_flag(Has_unweighted_input_epsilon_cycles);
         }
 
         // state_index must be an index to a state which is defined as either:
@@ -737,15 +766,6 @@ namespace hfst_ol {
         TransitionTableIndexSet
         get_transitions_from_state(TransitionTableIndex state_index) const;
 
-        bool initialize_input(const char *input_str);
-        std::vector<std::string> multi_lookup(const StringVector &strs);
-
-        std::vector<std::vector<std::string> > multi_doc_lookup(const std::vector<std::string> &docs);
-        std::vector<std::pair<std::string, Weight>> lookup(const StringVector &s);
-        std::vector<std::pair<std::string, Weight>> lookup(const std::string &s);
-        std::vector<std::pair<std::string, Weight>> lookup(const char *s);
-        void note_analysis(SymbolNumber *whole_output_tape);
-
         // Methods for supporting ospell
         SymbolNumber get_unknown_symbol(void) const {
           return alphabet->get_unknown_symbol();
@@ -754,7 +774,7 @@ namespace hfst_ol {
           return alphabet->build_string_symbol_map();
         }
         STransition take_epsilons(const TransitionTableIndex i) const;
-        STransition take_epsilons_and_flags(const TransitionTableIndex i);
+        STransition take_epsilons_and_flags(const TransitionTableIndex i) const;
         STransition take_non_epsilons(const TransitionTableIndex i,
                                       const SymbolNumber symbol) const;
         TransitionTableIndex next(const TransitionTableIndex i,
@@ -762,16 +782,419 @@ namespace hfst_ol {
         TransitionTableIndex next_e(const TransitionTableIndex i) const;
         bool has_transitions(const TransitionTableIndex i,
                              const SymbolNumber symbol) const;
-        bool has_epsilons_or_flags(const TransitionTableIndex i);
+        bool has_epsilons_or_flags(const TransitionTableIndex i) const;
         Weight final_weight(const TransitionTableIndex i) const;
-        bool is_flag(const SymbolNumber symbol) {
+        bool is_flag(const SymbolNumber symbol) const {
           return alphabet->is_flag_diacritic(symbol);
         }
-        bool is_weighted(void) { return header->probe_flag(Weighted); }
+        bool is_weighted(void) const { return header->probe_flag(Weighted); }
 
         friend class ConvertTransducer;
     };
 
+    // Memory for what one lookup makes along the way. It is handed out by
+    // bumping a pointer through a block that is kept from one lookup to the
+    // next, and reset() takes it all back at once, so once the block is as
+    // big as the biggest lookup has needed, looking up allocates nothing.
+    class LookupArena {
+    public:
+        LookupArena() : used(0), total_used(0) {}
+        ~LookupArena();
+
+        void *allocate(size_t size, size_t alignment);
+        template <class T>
+        T *allocate(size_t count = 1) {
+            return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+        }
+        // Free everything allocated since the last reset
+        void reset();
+
+    private:
+        struct Block {
+            char *data;
+            size_t size;
+        };
+        static const size_t FIRST_BLOCK_SIZE = 4096;
+
+        std::vector<Block> blocks; // only the last one is being filled
+        size_t used; // of the last block
+        size_t total_used; // of the blocks before it
+
+        LookupArena(const LookupArena &);
+        LookupArena &operator=(const LookupArena &);
+    };
+
+    // How far a lookup goes: a path is cut off after max_epsilon_depth
+    // epsilons and flag diacritics, and the lookup stops once it has found
+    // max_analyses analyses, keeping the ones found first
+    struct LookupLimits {
+        size_t max_epsilon_depth;
+        size_t max_analyses;
+
+        LookupLimits() : max_epsilon_depth(MAX_EPSILON_DEPTH),
+                         max_analyses(std::numeric_limits<size_t>::max()) {}
+    };
+
+    // What one lookup at a time changes: the tapes, the flag state and the
+    // results. Each thread looks up with a context of its own over a shared
+    // model, which must outlive it.
+    class LookupContext {
+    public:
+        // An analysis of the last input looked up, in the context's arena
+        struct Analysis {
+            const char *text; // NUL-terminated
+            size_t length;
+            Weight weight;
+            const Analysis *next;
+        };
+
+    protected:
+        const TransducerModel &model;
+        const TransducerTablesInterface &tables;
+        const TransducerAlphabet &alphabet;
+
+        Weight current_weight;
+        LookupArena arena;
+        const Analysis *first_analysis;
+        Analysis *last_found;
+        size_t analysis_count;
+        LookupLimits limits;
+        // The output tape is made longer when a path reaches its end, up
+        // to a transition for each input symbol and
+        // limits.max_epsilon_depth more
+        SymbolNumberVector input_tape;
+        SymbolNumberVector output_tape;
+        bool output_tape_full;
+        hfst::FdState<SymbolNumber> flag_state;
+
+        // A state on the path being followed
+        struct PathStep {
+            TransitionTableIndex state;
+            const SymbolNumber *input_symbol;
+            size_t flag_mark; // how long flag_log was on reaching it
+        };
+
+        // If the transducer is infinitely ambiguous, the states on the path
+        // and the flag diacritic values changed along it are kept, and an
+        // epsilon or flag diacritic back to a state on the path at the same
+        // input position with the same flag state is not taken
+        bool check_cycles;
+        std::vector<PathStep> path;
+        std::vector<std::pair<hfst::FdFeature, hfst::FdValue> > flag_log;
+
+        bool revisits(TransitionTableIndex state,
+                      const SymbolNumber *input_symbol) const;
+        bool flags_unchanged_since(size_t mark) const;
+
+        // get_analyses(), keeping track of the path if need be
+        void visit(SymbolNumber *input_symbol, SymbolNumber *output_symbol,
+                   SymbolNumber *original_output_tape, TransitionTableIndex i) {
+            if (check_cycles) {
+                PathStep step = {i, input_symbol, flag_log.size()};
+                path.push_back(step);
+                get_analyses(input_symbol, output_symbol, original_output_tape, i);
+                path.pop_back();
+            } else {
+                get_analyses(input_symbol, output_symbol, original_output_tape, i);
+            }
+        }
+
+        void try_epsilon_transitions(SymbolNumber *input_symbol,
+                                     SymbolNumber *output_symbol,
+                                     SymbolNumber *original_output_tape,
+                                     TransitionTableIndex i);
+
+        void try_epsilon_indices(SymbolNumber *input_symbol,
+                                 SymbolNumber *output_symbol,
+                                 SymbolNumber *original_output_tape,
+                                 TransitionTableIndex i);
+
+        void find_transitions(SymbolNumber input, SymbolNumber *input_symbol,
+                              SymbolNumber *output_symbol,
+                              SymbolNumber *original_output_tape,
+                              TransitionTableIndex i);
+
+        void find_index(SymbolNumber input, SymbolNumber *input_symbol,
+                        SymbolNumber *output_symbol,
+                        SymbolNumber *original_output_tape, TransitionTableIndex i);
+
+        void get_analyses(SymbolNumber *input_symbol, SymbolNumber *output_symbol,
+                          SymbolNumber *original_output_tape, TransitionTableIndex i);
+
+    private:
+        LookupContext(const LookupContext &);
+        LookupContext &operator=(const LookupContext &);
+
+    public:
+        explicit LookupContext(const TransducerModel &m);
+        ~LookupContext();
+
+        const TransducerModel &get_model(void) const { return model; }
+        void set_limits(const LookupLimits &l) { limits = l; }
+
+        bool initialize_input(const char *input_str);
+        // Look up s and return its first analysis, or NULL if it has none.
+        // The analyses stay valid until the next lookup in this context.
+        const Analysis *analyze(const char *s);
+        const Analysis *last_analysis(void) const { return last_found; }
+        std::vector<std::pair<std::string, Weight>> lookup(const std::string &s);
+        std::vector<std::pair<std::string, Weight>> lookup(const char *s);
+        void note_analysis(SymbolNumber *whole_output_tape);
+    };
+
+    // LookupContexts over one model for whichever threads are looking up
+    // in it: a lookup takes one that no other thread is using, and gives it
+    // back when it's done. There are only ever as many as were in use at once.
+    class ContextPool {
+    private:
+        const TransducerModel &model;
+        std::mutex lock;
+        std::vector<LookupContext *> idle;
+        LookupLimits limits; // for every context handed out
+
+        ContextPool(const ContextPool &);
+        ContextPool &operator=(const ContextPool &);
+
+    public:
+        explicit ContextPool(const TransducerModel &m) : model(m) {}
+        ~ContextPool();
+
+        LookupContext *acquire();
+        void release(LookupContext *context);
+        // For the lookups started from now on
+        void set_limits(const LookupLimits &l);
+
+        // A context of the pool for as long as it lives
+        class Lease {
+        private:
+            ContextPool &pool;
+            LookupContext *context;
+
+            Lease(const Lease &);
+            Lease &operator=(const Lease &);
+
+        public:
+            explicit Lease(ContextPool &p) : pool(p), context(p.acquire()) {}
+            ~Lease() { pool.release(context); }
+
+            LookupContext &operator*() const { return *context; }
+            LookupContext *operator->() const { return context; }
+        };
+    };
+
+    // How a ResultCache has done, for sizing it
+    struct CacheStats {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    // multi_lookup() results within a fixed memory budget, shared by any
+    // number of threads. Inputs are spread over shards by their hash, each
+    // with a lock and a share of the budget of its own, so threads rarely
+    // wait for each other. A full shard drops its least recently used
+    // entries to make room.
+    class ResultCache {
+    public:
+        static const size_t DEFAULT_BYTES = 64 << 20;
+
+        explicit ResultCache(size_t max_bytes = DEFAULT_BYTES);
+
+        // If input is cached, put its result in result
+        bool find(const std::string &input, std::string &result);
+        void insert(const std::string &input, const std::string &result);
+        void clear();
+        CacheStats stats() const;
+
+        // Call f(input, result) for every entry, a shard at a time
+        template <class Function>
+        void for_each(Function f) const {
+            for (size_t i = 0; i < SHARD_COUNT; ++i) {
+                std::lock_guard<std::mutex> guard(shards[i].lock);
+                for (auto it = shards[i].entries.cbegin();
+                     it != shards[i].entries.cend(); ++it) {
+                    f(it->first, it->second);
+                }
+            }
+        }
+
+    private:
+        typedef std::list<std::pair<std::string, std::string> > EntryList;
+
+        // The index is keyed by the inputs in the entries, not copies of them
+        struct InputHash {
+            size_t operator()(const std::string *s) const {
+                return std::hash<std::string>()(*s);
+            }
+        };
+        struct InputEqual {
+            bool operator()(const std::string *a, const std::string *b) const {
+                return *a == *b;
+            }
+        };
+
+        struct Shard {
+            mutable std::mutex lock;
+            EntryList entries; // the most recently used first
+            std::unordered_map<const std::string *, EntryList::iterator,
+                               InputHash, InputEqual> index;
+            size_t bytes;
+            unsigned long long hits;
+            unsigned long long misses;
+            unsigned long long evictions;
+
+            Shard() : bytes(0), hits(0), misses(0), evictions(0) {}
+        };
+
+        static const size_t SHARD_COUNT = 16;
+        // about what an entry takes besides the text of its strings
+        static const size_t ENTRY_OVERHEAD = 128;
+
+        size_t shard_budget;
+        Shard shards[SHARD_COUNT];
+
+        Shard &shard_for(const std::string &input) {
+            return shards[std::hash<std::string>()(input) % SHARD_COUNT];
+        }
+
+        static size_t entry_bytes(const std::string &input,
+                                  const std::string &result) {
+            return input.size() + result.size() + ENTRY_OVERHEAD;
+        }
+
+        ResultCache(const ResultCache &);
+        ResultCache &operator=(const ResultCache &);
+    };
+
+    // multi_lookup() results saved by an earlier process, mapped read-only
+    // from a file, so they are there from the first lookup on. The file is
+    // a CacheFileHeader, a hash table of CacheFileSlots and then the text
+    // of the inputs and results, in native byte order. Any number of
+    // threads may find() in it at once.
+    class MappedResultCache {
+    public:
+        struct CacheFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t slot_count; // a power of two
+            uint64_t transducer_identity;
+            uint64_t entry_count;
+            uint64_t text_size;
+        };
+
+        struct CacheFileSlot {
+            uint64_t hash;
+            uint32_t input_offset; // EMPTY_SLOT if there's no entry here
+            uint32_t input_length;
+            uint32_t result_offset;
+            uint32_t result_length;
+        };
+
+        static const char MAGIC[8];
+        static const uint32_t VERSION = 1;
+        static const uint32_t EMPTY_SLOT = 0xffffffff;
+
+        MappedResultCache() : mapping(NULL), mapping_size(0), header(NULL),
+                              slots(NULL), text(NULL) {}
+        ~MappedResultCache() { unmap(); }
+
+        // Map filename if it's a cache for the transducer with identity;
+        // otherwise keep no entries and return false
+        bool map(const std::string &filename, uint64_t identity);
+        void unmap();
+
+        bool find(const std::string &input, std::string &result) const;
+
+        // Call f(input, result) for every entry
+        template <class Function>
+        void for_each(Function f) const {
+            for (size_t i = 0; header != NULL && i < header->slot_count; ++i) {
+                const CacheFileSlot &slot = slots[i];
+                if (slot.input_offset != EMPTY_SLOT) {
+                    f(std::string(text + slot.input_offset, slot.input_length),
+                      std::string(text + slot.result_offset, slot.result_length));
+                }
+            }
+        }
+
+        // Write entries, a vector of (input, result), as a cache for the
+        // transducer with identity. The file is replaced in one step, so
+        // processes that have the old one mapped go on reading it.
+        static void write(const std::string &filename, uint64_t identity,
+                          const std::vector<std::pair<std::string, std::string> > &entries);
+
+        static uint64_t hash_input(const char *input, size_t length);
+
+    private:
+        void *mapping;
+        size_t mapping_size;
+        const CacheFileHeader *header;
+        const CacheFileSlot *slots;
+        const char *text;
+
+        MappedResultCache(const MappedResultCache &);
+        MappedResultCache &operator=(const MappedResultCache &);
+    };
+
+    // A model with a cache of multi_lookup() results. lookup() and
+    // multi_lookup() may be called from any number of threads at once;
+    // initialize_input() and note_analysis() work on a context of the
+    // Transducer's own, for one thread only.
+    class Transducer : public TransducerModel {
+    protected:
+        LookupContext context;
+        ContextPool contexts;
+        ResultCache cached_results;
+        MappedResultCache saved_results;
+
+    public:
+        Transducer(const std::string &filename,
+                   size_t cache_bytes = ResultCache::DEFAULT_BYTES);
+
+        void write_lookup_cache();
+        // Save the cached results to filename, to be loaded by later
+        // processes with the same transducer
+        void save_lookup_cache(const std::string &filename);
+        // Map results saved from this transducer, before looking up with
+        // it. Returns false if filename isn't a cache for it.
+        bool load_lookup_cache(const std::string &filename) {
+          return saved_results.map(filename, get_identity());
+        }
+        CacheStats cache_stats() const { return cached_results.stats(); }
+        void clear_cache() { cached_results.clear(); }
+        // Bound the lookups started from now on (max_analyses 0 for no
+        // limit). They may give other results than before, so the cache is
+        // cleared; a cache loaded from a file is taken to have been made
+        // with the same limits.
+        void set_lookup_limits(size_t max_epsilon_depth, size_t max_analyses);
+
+        bool initialize_input(const char *input_str) {
+          return context.initialize_input(input_str);
+        }
+        std::vector<std::string> multi_lookup(const StringVector &strs);
+
+        // Split each of docs on whitespace and replace each token with its
+        // analysis, stripped of tags, or with the token itself if it has
+        // none. Each distinct token is looked up once, and the work is
+        // spread over threads (by default one per hardware thread).
+        std::vector<std::vector<std::string> > multi_doc_lookup(const std::vector<std::string> &docs,
+                                                                size_t threads = 0);
+        std::vector<std::pair<std::string, Weight>> lookup(const StringVector &s);
+        std::vector<std::pair<std::string, Weight>> lookup(const std::string &s) {
+          ContextPool::Lease lease(contexts);
+          return lease->lookup(s);
+        }
+        std::vector<std::pair<std::string, Weight>> lookup(const char *s) {
+          ContextPool::Lease lease(contexts);
+          return lease->lookup(s);
+        }
+        void note_analysis(SymbolNumber *whole_output_tape) {
+          context.note_analysis(whole_output_tape);
+        }
+    };
+
     class STransition {
     public:
         TransitionTableIndex index;
@@ -35,6 +35,7 @@ bool print_usage(void)
     "  -h, --help                  Print this help message\n" <<
     "  -V, --version               Print version information\n" <<
     "  -v, --verbose               Be verbose\n" <<
+    "                              (and print the time spent in lookup at the end)\n" <<
     "  -q, --quiet                 Don't be verbose (default)\n" <<
     "  -s, --silent                Same as quiet\n" <<
     "  -e, --echo                  Echo inputs\n" <<
@@ -43,10 +44,27 @@ bool print_usage(void)
     "  -u, --unique                Suppress duplicate analyses\n" <<
     "  -n N, --analyses=N          Output no more than N analyses\n" <<
     "                              (if the transducer is weighted, the N best analyses)\n" <<
+    "  -b B, --beam=B              Output only analyses within B of the best one\n" <<
+    "                              (if the transducer is weighted)\n" <<
+    "  -W W, --max-weight=W        Output only analyses weighing at most W\n" <<
+    "                              (if the transducer is weighted)\n" <<
     "  -x, --xerox                 Xerox output format (default)\n" <<
     "  -f, --fast                  Be as fast as possible.\n" <<
     "                              (with this option enabled -u and -n don't work and\n" <<
     "                              output won't be ordered by weight).\n" <<
+    "  -m, --mmap                  Map the transducer into memory instead of reading it\n" <<
+    "                              (faster startup, memory shared between processes)\n" <<
+    "  -j N, --jobs=N              Look up with N threads sharing the transducer\n" <<
+    "                              (output stays in the order of the input)\n" <<
+    "  -c N, --cache-size=N        Keep the output of up to N recent inputs\n" <<
+    "                              (for each thread) and reuse it when they recur\n" <<
+    "  -p P, --project=P           Print only part of each analysis: P is lemma,\n" <<
+    "                              lemma+pos (the lemma and the first tag after it)\n" <<
+    "                              or tags\n" <<
+    "  -E N, --max-epsilons=N      Cut off paths taking more than N transitions beyond\n" <<
+    "                              one for each input symbol (default 1000)\n" <<
+    "  -l N, --limit=N             Stop looking up an input after finding N analyses\n" <<
+    "                              (the first N found, always the same ones)\n" <<
     "\n" <<
     "Note that " << PACKAGE_NAME << " is *not* guaranteed to behave identically to\n" <<
     "hfst-lookup (although it almost always does): input-side multicharacter symbols\n" <<
@@ -77,6 +95,7 @@ bool print_short_help(void)
 int main(int argc, char **argv)
 {
   int c;
+  char * endptr;
   
   while (true)
     {
@@ -94,12 +113,20 @@ int main(int argc, char **argv)
 	  {"unique",       no_argument,       0, 'u'},
 	  {"xerox",        no_argument,       0, 'x'},
 	  {"fast",         no_argument,       0, 'f'},
+	  {"mmap",         no_argument,       0, 'm'},
 	  {"analyses",     required_argument, 0, 'n'},
+	  {"beam",         required_argument, 0, 'b'},
+	  {"max-weight",   required_argument, 0, 'W'},
+	  {"jobs",         required_argument, 0, 'j'},
+	  {"cache-size",   required_argument, 0, 'c'},
+	  {"project",      required_argument, 0, 'p'},
+	  {"max-epsilons", required_argument, 0, 'E'},
+	  {"limit",        required_argument, 0, 'l'},
 	  {0,              0,                 0,  0 }
 	};
       
       int option_index = 0;
-      c = getopt_long(argc, argv, "hVvqsewuxfn:", long_options, &option_index);
+      c = getopt_long(argc, argv, "hVvqsewuxfmn:b:W:j:c:p:E:l:", long_options, &option_index);
 
       if (c == -1) // no more options to look at
 	break;
@@ -162,6 +189,95 @@ int main(int argc, char **argv)
 	    }
 	  break;
 
+	case 'b':
+	  beamWidth = strtof(optarg, &endptr);
+	  if (endptr == optarg || *endptr != '\0' || !(beamWidth >= 0.0))
+	    {
+	      std::cerr << "Invalid or no argument for beam width\n";
+	      return EXIT_FAILURE;
+	    }
+	  break;
+
+	case 'W':
+	  maxWeight = strtof(optarg, &endptr);
+	  if (endptr == optarg || *endptr != '\0' || maxWeight != maxWeight)
+	    {
+	      std::cerr << "Invalid or no argument for maximum weight\n";
+	      return EXIT_FAILURE;
+	    }
+	  break;
+
+	case 'j':
+	  threadCount = atoi(optarg);
+	  if (threadCount < 1)
+	    {
+	      std::cerr << "Invalid or no argument for thread count\n";
+	      return EXIT_FAILURE;
+	    }
+	  break;
+
+	case 'c':
+	  {
+	    errno = 0;
+	    long size = strtol(optarg, &endptr, 10);
+	    if (endptr == optarg || *endptr != '\0' || errno == ERANGE ||
+		size < 0 || size > INT_MAX)
+	      {
+		std::cerr << "Invalid or no argument for cache size\n";
+		return EXIT_FAILURE;
+	      }
+	    cacheSize = size;
+	  }
+	  break;
+
+	case 'p':
+	  if (strcmp(optarg, "lemma") == 0)
+	    {
+	      outputProjection = LEMMA;
+	    }
+	  else if (strcmp(optarg, "lemma+pos") == 0)
+	    {
+	      outputProjection = LEMMA_POS;
+	    }
+	  else if (strcmp(optarg, "tags") == 0)
+	    {
+	      outputProjection = TAGS;
+	    }
+	  else
+	    {
+	      std::cerr << "Invalid or no argument for projection\n";
+	      return EXIT_FAILURE;
+	    }
+	  break;
+
+	case 'E':
+	  {
+	    errno = 0;
+	    long epsilons = strtol(optarg, &endptr, 10);
+	    if (endptr == optarg || *endptr != '\0' || errno == ERANGE ||
+		epsilons < 0 || epsilons > INT_MAX)
+	      {
+		std::cerr << "Invalid or no argument for epsilon limit\n";
+		return EXIT_FAILURE;
+	      }
+	    maxEpsilons = epsilons;
+	  }
+	  break;
+
+	case 'l':
+	  {
+	    errno = 0;
+	    long limit = strtol(optarg, &endptr, 10);
+	    if (endptr == optarg || *endptr != '\0' || errno == ERANGE ||
+		limit < 1 || limit > INT_MAX)
+	      {
+		std::cerr << "Invalid or no argument for analysis limit\n";
+		return EXIT_FAILURE;
+	      }
+	    searchLimit = limit;
+	  }
+	  break;
+
 	case 'x':
 	  outputType = xerox;
 	  break;
@@ -169,6 +285,10 @@ int main(int argc, char **argv)
 	case 'f':
 	  beFast = true;
 	  break;
+
+	case 'm':
+	  mmapTransducerFlag = true;
+	  break;
 	  
 	default:
 	  std::cerr << "Invalid option\n\n";
@@ -311,1248 +431,1764 @@ void TransducerAlphabet::get_next_symbol(FILE * f, SymbolNumber k)
   kt->operator[](k) = strdup(line);
 }
 
-void LetterTrie::add_string(const char * p, SymbolNumber symbol_key)
+SymbolClass classify_symbol(const char * symbol, bool flag)
 {
-  if (*(p+1) == 0)
+  if (flag)
     {
-      symbols[(unsigned char)(*p)] = symbol_key;
-      return;
+      return FLAG_SYMBOL;
+    }
+  size_t characters = 0;
+  bool boundary = *symbol != '\0';
+  for (const char * c = symbol; *c != '\0'; ++c)
+    {
+      if ((*c & 0xc0) != 0x80) // not a UTF-8 continuation byte
+	{
+	  ++characters;
+	}
+      if (*c != '#' && *c != '+')
+	{
+	  boundary = false;
+	}
     }
-  if (letters[(unsigned char)(*p)] == NULL)
+  if (boundary && strchr(symbol, '#') != NULL)
     {
-      letters[(unsigned char)(*p)] = new LetterTrie();
+      return BOUNDARY_SYMBOL;
     }
-  letters[(unsigned char)(*p)]->add_string(p+1,symbol_key);
+  return characters > 1 ? TAG_SYMBOL : LEMMA_SYMBOL;
 }
 
-SymbolNumber LetterTrie::find_key(char ** p)
+LetterTrie::LetterTrie(void):
+  cells(1)
 {
-  const char * old_p = *p;
-  ++(*p);
-  if (letters[(unsigned char)(*old_p)] == NULL)
-    {
-      return symbols[(unsigned char)(*old_p)];
+  cells[0].base = 0;
+  cells[0].check = -1;
+  cells[0].symbol = NO_SYMBOL_NUMBER;
+}
+
+void LetterTrie::build(const std::vector<const char *> & symbols)
+{
+  // First an ordinary trie, with the children of each node by byte
+  std::vector<std::map<unsigned char, size_t> > children(1);
+  SymbolNumberVector node_symbols(1, NO_SYMBOL_NUMBER);
+  for (size_t k = 0; k < symbols.size(); ++k)
+    {
+      const unsigned char * p = (const unsigned char *)(symbols[k]);
+      if (p == NULL || *p == 0)
+	{ // epsilon is never read from the input
+	  continue;
+	}
+      size_t node = 0;
+      for (; *p != 0; ++p)
+	{
+	  std::map<unsigned char, size_t>::iterator it = children[node].find(*p);
+	  if (it == children[node].end())
+	    {
+	      children[node][*p] = children.size();
+	      node = children.size();
+	      children.push_back(std::map<unsigned char, size_t>());
+	      node_symbols.push_back(NO_SYMBOL_NUMBER);
+	    }
+	  else
+	    {
+	      node = it->second;
+	    }
+	}
+      node_symbols[node] = k;
+    }
+
+  // Then place the nodes breadth first, the children of each at the lowest
+  // base where all their cells are free
+  Cell free_cell = {0, -1, NO_SYMBOL_NUMBER};
+  cells.assign(1, free_cell);
+  std::vector<size_t> cell_of(children.size(), 0);
+  std::vector<size_t> queue(1, 0);
+  size_t first_free = 1;
+  for (size_t q = 0; q < queue.size(); ++q)
+    {
+      size_t node = queue[q];
+      size_t cell = cell_of[node];
+      cells[cell].symbol = node_symbols[node];
+      if (children[node].empty())
+	{
+	  continue;
+	}
+      unsigned char lowest = children[node].begin()->first;
+      unsigned char highest = children[node].rbegin()->first;
+      TransitionTableIndex base = first_free > lowest ? first_free - lowest : 0;
+      for (;; ++base)
+	{
+	  std::map<unsigned char, size_t>::iterator it = children[node].begin();
+	  for (; it != children[node].end(); ++it)
+	    {
+	      if (base + it->first < cells.size() &&
+		  cells[base + it->first].check != -1)
+		{
+		  break;
+		}
+	    }
+	  if (it == children[node].end())
+	    {
+	      break;
+	    }
+	}
+      if (base + highest >= cells.size())
+	{
+	  cells.resize(base + highest + 1, free_cell);
+	}
+      cells[cell].base = base;
+      for (std::map<unsigned char, size_t>::iterator it = children[node].begin();
+	   it != children[node].end(); ++it)
+	{
+	  cells[base + it->first].check = (int)(cell);
+	  cell_of[it->second] = base + it->first;
+	  queue.push_back(it->second);
+	}
+      while (first_free < cells.size() && cells[first_free].check != -1)
+	{
+	  ++first_free;
+	}
     }
-  SymbolNumber s = letters[(unsigned char)(*old_p)]->find_key(p);
-  if (s == NO_SYMBOL_NUMBER)
-    {
-      --(*p);
-      return symbols[(unsigned char)(*old_p)];
+  // Room for any byte after the last base, so that find_key() never has to
+  // check the size
+  cells.resize(cells.size() + UCHAR_MAX + 1, free_cell);
+}
+
+SymbolNumber LetterTrie::find_key(char ** p) const
+{
+  const unsigned char * s = (const unsigned char *)(*p);
+  SymbolNumber found = NO_SYMBOL_NUMBER;
+  const unsigned char * found_end = s;
+  int cell = 0;
+  for (; *s != 0; ++s)
+    {
+      TransitionTableIndex next = cells[cell].base + *s;
+      if (cells[next].check != cell)
+	{
+	  break;
+	}
+      cell = next;
+      if (cells[cell].symbol != NO_SYMBOL_NUMBER)
+	{
+	  found = cells[cell].symbol;
+	  found_end = s + 1;
+	}
     }
-  return s;
+  *p = (char *)(found_end);
+  return found;
 }
 
 void Encoder::read_input_symbols(KeyTable * kt)
 {
+  std::vector<const char *> symbols(number_of_input_symbols, (const char *) NULL);
+  // the pairs that begin a longer symbol have to go through the trie
+  std::vector<bool> pair_extended(utf8_symbols.size(), false);
   for (SymbolNumber k = 0; k < number_of_input_symbols; ++k)
     {
 #if DEBUG
       assert(kt->find(k) != kt->end());
 #endif
       const char * p = kt->operator[](k);
-      if ((strlen(p) == 1) && (unsigned char)(*p) <= 127)
+      const unsigned char * u = (const unsigned char *)(p);
+      size_t length = strlen(p);
+      if ((length == 1) && (unsigned char)(*p) <= 127)
 	{
 	  ascii_symbols[(unsigned char)(*p)] = k;
 	}
-      letters.add_string(p,k);
+      if (length >= 2 && is_utf8_pair(u))
+	{
+	  if (length == 2)
+	    {
+	      utf8_symbols[utf8_pair_index(u)] = k;
+	    }
+	  else
+	    {
+	      pair_extended[utf8_pair_index(u)] = true;
+	    }
+	}
+      symbols[k] = p;
+    }
+  for (size_t i = 0; i < utf8_symbols.size(); ++i)
+    {
+      if (pair_extended[i])
+	{
+	  utf8_symbols[i] = NO_SYMBOL_NUMBER;
+	}
     }
+  letters.build(symbols);
 }
 
-SymbolNumber Encoder::find_key(char ** p)
+SymbolNumber Encoder::find_key(char ** p) const
 {
-  if (ascii_symbols[(unsigned char)(**p)] == NO_SYMBOL_NUMBER)
-    {
-      return letters.find_key(p);
-    }
-  SymbolNumber s = ascii_symbols[(unsigned char)(**p)];
-  ++(*p);
-  return s;
+  const unsigned char * s = (const unsigned char *)(*p);
+  SymbolNumber k = next_symbol(&s);
+  *p = (char *)(s);
+  return k;
 }
 
-template <class genericTransducer>
-void runTransducer (genericTransducer T)
+inline SymbolNumber Encoder::next_symbol(const unsigned char ** s) const
 {
-  SymbolNumber * input_string = (SymbolNumber*)(malloc(2000));
-  for (int i = 0; i < 1000; ++i)
+  SymbolNumber k = ascii_symbols[**s];
+  if (k != NO_SYMBOL_NUMBER)
     {
-      input_string[i] = NO_SYMBOL_NUMBER;
+      ++(*s);
+      return k;
     }
-  
-  char * str = (char*)(malloc(MAX_IO_STRING*sizeof(char)));  
-  *str = 0;
-  char * old_str = str;
-
-  while(std::cin.getline(str,MAX_IO_STRING))
+  if (is_utf8_pair(*s))
     {
-      if (echoInputsFlag)
+      k = utf8_symbols[utf8_pair_index(*s)];
+      if (k != NO_SYMBOL_NUMBER)
 	{
-	  std::cout << str << std::endl;
+	  *s += 2;
+	  return k;
 	}
-      int i = 0;
-      SymbolNumber k = NO_SYMBOL_NUMBER;
-      bool failed = false;
-      for ( char ** Str = &str; **Str != 0; )
+    }
+  char * p = (char *)(*s);
+  k = letters.find_key(&p);
+  *s = (const unsigned char *)(p);
+  return k;
+}
+
+bool Encoder::encode(char * str, size_t length, SymbolNumber * symbols) const
+{
+  const unsigned char * s = (const unsigned char *)(str);
+  const unsigned char * end = s + length;
+  while (s < end && *s != 0)
+    { // the line ends at a NUL, as it did before lines had a length
+      SymbolNumber k = next_symbol(&s);
+      if (k == NO_SYMBOL_NUMBER)
 	{
-	  k = T.find_next_key(Str);
-#if OL_FULL_DEBUG
-	  std::cout << "INPUT STRING ENTRY " << i << " IS " << k << std::endl;
-#endif
-	  if (k == NO_SYMBOL_NUMBER)
-	    {
-	      if (echoInputsFlag)
-		{
-		  std::cout << std::endl;
-		}
-	      failed = true;
-	      break;
-	    }
-	  input_string[i] = k;
-	  ++i;
+	  return false;
 	}
-      str = old_str;
-      if (failed)
-      	{ // tokenization failed
-	  if (outputType == xerox)
-	    {
-	      std::cout << str << "\t+?" << std::endl;
-	      std::cout << std::endl;
-	    }
-      	  continue;
-      	}
-      input_string[i] = NO_SYMBOL_NUMBER;
-      T.analyze(input_string);
-      T.printAnalyses(std::string(str));
+      *symbols = k;
+      ++symbols;
     }
+  *symbols = NO_SYMBOL_NUMBER;
+  return true;
 }
 
-int setup(FILE * f)
+TransducerTables::TransducerTables(FILE * f, size_t size, bool map):
+  tables(NULL),
+  mapping(NULL),
+  mapping_size(0)
 {
-  TransducerHeader header(f);
-  TransducerAlphabet alphabet(f, header.symbol_count());
-
-  if (header.probe_flag(Has_unweighted_input_epsilon_cycles) ||
-      header.probe_flag(Has_input_epsilon_cycles))
+  if (map && map_tables(f, size))
     {
-      std::cerr << "!! Warning: transducer has epsilon cycles                  !!\n"
-		<< "!! This is currently not handled - if they are encountered !!\n"
-		<< "!! program *will* segfault.                                !!\n";
+      return;
     }
-  
-  if (alphabet.get_state_size() == 0)
-    {      // if the state size is zero, there are no flag diacritics to handle
-      if (header.probe_flag(Weighted) == false)
-	{
-	  if (displayUniqueFlag)
-	    { // no flags, no weights, unique analyses only
-	      TransducerUniq C(f, header, alphabet);
-	      runTransducer(C);
-	    } else if (!displayUniqueFlag)
-	    { // no flags, no weights, all analyses
-	    Transducer C(f, header, alphabet);
-	    runTransducer(C);
-	    }
-	}
-      else if (header.probe_flag(Weighted) == true)
-	{
-	  if (displayUniqueFlag)
-	    { // no flags, weights, unique analyses only
-	      TransducerWUniq C(f, header, alphabet);
-	      runTransducer(C);
-	    } else if (!displayUniqueFlag)
-	    { // no flags, weights, all analyses
-	      TransducerW C(f, header, alphabet);
-	      runTransducer(C);
-	    }
-	}
-    } else // handle flag diacritics
+  tables = (char*)(malloc(size + TABLE_PADDING));
+  if (fread(tables, size, 1, f) != 1 && size != 0)
     {
-      if (header.probe_flag(Weighted) == false)
-	{
-	  if (displayUniqueFlag)
-	    { // flags, no weights, unique analyses only
-	      TransducerFdUniq C(f, header, alphabet);
-	      runTransducer(C);
-	    } else
-	    { // flags, no weights, all analyses
-	      TransducerFd C(f, header, alphabet);
-	      runTransducer(C);
-	    }
-	}
-      else if (header.probe_flag(Weighted) == true)
-	{
-	  if (displayUniqueFlag)
-	    { // flags, weights, unique analyses only
-	      TransducerWFdUniq C(f, header, alphabet);
-	      runTransducer(C);
-	    } else
-	    { // flags, no weights, all analyses
-	      TransducerWFd C(f, header, alphabet);
-	      runTransducer(C);
-	    }
-	}
+      std::cerr << "Could not parse transducer; wrong or corrupt file?" << std::endl;
+      exit(1);
     }
-  return 0;
-}
-
-/**
- * BEGIN old transducer.cc
- */
-
-bool TransducerFd::PushState(FlagDiacriticOperation op)
-{ // try to alter the flag diacritic state stack
-  switch (op.Operation()) {
-  case P: // positive set
-    statestack.push_back(statestack.back());
-    statestack.back()[op.Feature()] = op.Value();
-    return true;
-  case N: // negative set (literally, in this implementation)
-    statestack.push_back(statestack.back());
-    statestack.back()[op.Feature()] = -1*op.Value();
-    return true;
-  case R: // require
-    if (op.Value() == 0) // empty require
-      {
-	if (statestack.back()[op.Feature()] == 0)
-	  {
-	    return false;
-	  }
-	else
-	  {
-	    statestack.push_back(statestack.back());
-	    return true;
-	  }
-      }
-    if (statestack.back()[op.Feature()] == op.Value())
-      {
-	statestack.push_back(statestack.back());
-	return true;
-      }
-    return false;
-  case D: // disallow
-        if (op.Value() == 0) // empty disallow
-      {
-	if (statestack.back()[op.Feature()] != 0)
-	  {
-	    return false;
-	  }
-	else
-	  {
-	    statestack.push_back(statestack.back());
-	    return true;
-	  }
-      }
-    if (statestack.back()[op.Feature()] == op.Value()) // nonempty disallow
-      {
-	return false;
-      }
-    statestack.push_back(statestack.back());
-    return true;
-  case C: // clear
-    statestack.push_back(statestack.back());
-    statestack.back()[op.Feature()] = 0;
-    return true;
-  case U: // unification
-    if (statestack.back()[op.Feature()] == 0 || // if the feature is unset or
-	statestack.back()[op.Feature()] == op.Value() || // the feature is at this value already or
-	(statestack.back()[op.Feature()] < 0 &&
-	 (statestack.back()[op.Feature()] * -1 != op.Value())) // the feature is negatively set to something else
-	)
-      {
-	statestack.push_back(statestack.back());
-	statestack.back()[op.Feature()] = op.Value();
-	return true;
-      }
-    return false;
-  }
-  throw; // for the compiler's peace of mind
+  memset(tables + size, 0xff, TABLE_PADDING);
 }
 
-bool TransitionIndex::matches(SymbolNumber s)
+bool TransducerTables::map_tables(FILE * f, size_t size)
 {
-  
-  if (input_symbol == NO_SYMBOL_NUMBER)
+  struct stat file_info;
+  long offset = ftell(f);
+  if (offset < 0 || fstat(fileno(f), &file_info) != 0 ||
+      !S_ISREG(file_info.st_mode))
+    { // not a regular file, so read it in the usual way
+      return false;
+    }
+  size_t end = offset + size;
+  if ((size_t)(file_info.st_size) < end)
+    {
+      std::cerr << "Could not parse transducer; wrong or corrupt file?" << std::endl;
+      exit(1);
+    }
+  // The whole pages of the file up to the end of the tables are shared with
+  // the page cache. The partial page at the end is copied into private
+  // memory so the padding can follow the tables directly.
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t shared_size = end - end % page_size;
+  mapping_size = shared_size +
+    ((end - shared_size + TABLE_PADDING + page_size - 1) / page_size) * page_size;
+  mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
     {
+      mapping = NULL;
       return false;
     }
-  if (s == NO_SYMBOL_NUMBER)
+  char * base = (char*)(mapping);
+  if ((shared_size > 0 &&
+       mmap(base, shared_size, PROT_READ, MAP_SHARED | MAP_FIXED,
+	    fileno(f), 0) == MAP_FAILED) ||
+      pread(fileno(f), base + shared_size, end - shared_size, shared_size) !=
+      (ssize_t)(end - shared_size))
     {
-      return true;
+      munmap(mapping, mapping_size);
+      mapping = NULL;
+      return false;
     }
-  return input_symbol == s;
+  memset(base + end, 0xff, TABLE_PADDING);
+  mprotect(base + shared_size, mapping_size - shared_size, PROT_READ);
+  tables = base + offset;
+  return true;
 }
 
-bool Transition::matches(SymbolNumber s)
+TransducerTables::~TransducerTables()
 {
-  
-  if (input_symbol == NO_SYMBOL_NUMBER)
+  if (mapping != NULL)
     {
-      return false;
+      munmap(mapping, mapping_size);
     }
-  if (s == NO_SYMBOL_NUMBER)
+  else
     {
-      return true;
+      free(tables);
     }
-  return input_symbol == s;
 }
 
-
-void IndexTableReader::get_index_vector(void)
+void OutputBuffer::put(Weight w)
 {
-  for (size_t i = 0;
-       i < number_of_table_entries;
-       ++i)
-    {
-      size_t j = i * TransitionIndex::SIZE;
-      SymbolNumber * input = (SymbolNumber*)(TableIndices + j);
-      TransitionTableIndex * index = 
-	(TransitionTableIndex*)(TableIndices + j + sizeof(SymbolNumber));
-      indices.push_back(new TransitionIndex(*input,*index));
-    }
+  char number[32];
+  int n = snprintf(number, sizeof(number), "%g", w);
+  put(number, n);
 }
 
-void TransitionTableReader::Set(TransitionTableIndex pos)
+void OutputBuffer::make_room(size_t n)
 {
-  if (pos >= TRANSITION_TARGET_TABLE_START)
+  if (fd >= 0)
     {
-      position = pos - TRANSITION_TARGET_TABLE_START;
+      flush();
+      return;
     }
-  else
+  capacity = std::max(2 * capacity, used + n);
+  buffer = static_cast<char *>(realloc(buffer, capacity));
+  if (buffer == NULL)
     {
-      position = pos;
+      std::cerr << "Out of memory writing output" << std::endl;
+      exit(1);
     }
 }
 
-void TransitionTableReader::get_transition_vector(void)
+void OutputBuffer::write_out(const char * s, size_t n)
 {
-  for (size_t i = 0; i < number_of_table_entries; ++i)
+  while (n > 0)
     {
-      size_t j = i * Transition::SIZE;
-      SymbolNumber * input = (SymbolNumber*)(TableTransitions + j);
-      SymbolNumber * output = 
-	(SymbolNumber*)(TableTransitions + j + sizeof(SymbolNumber));
-      TransitionTableIndex * target = 
-       (TransitionTableIndex*)(TableTransitions + j + 2 * sizeof(SymbolNumber));
-      transitions.push_back(new Transition(*input,
-					   *output,
-					   *target));
-      
+      ssize_t written = write(fd, s, n);
+      if (written < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  std::cerr << "Could not write output" << std::endl;
+	  exit(1);
+	}
+      s += written;
+      n -= written;
     }
 }
 
-bool TransitionTableReader::Matches(SymbolNumber s)
+void InputBuffer::fill(void)
 {
-  Transition * t = transitions[position];
-  return t->matches(s);
+  size_t left = end - start;
+  memmove(buffer, buffer + start, left);
+  scanned -= start;
+  start = 0;
+  end = left;
+  if (capacity - end < BLOCK_SIZE + 1)
+    { // a long line, make room for it
+      capacity *= 2;
+      buffer = static_cast<char *>(realloc(buffer, capacity));
+      if (buffer == NULL)
+	{
+	  std::cerr << "Out of memory reading input" << std::endl;
+	  exit(1);
+	}
+    }
+  while (true)
+    {
+      // leave room for the NUL after the last line
+      ssize_t got = read(STDIN_FILENO, buffer + end, capacity - end - 1);
+      if (got > 0)
+	{
+	  end += got;
+	  return;
+	}
+      if (got == 0)
+	{
+	  at_eof = true;
+	  return;
+	}
+      if (errno != EINTR)
+	{
+	  std::cerr << "Could not read input" << std::endl;
+	  exit(1);
+	}
+    }
 }
 
-bool TransitionTableReader::get_finality(TransitionTableIndex i)
+const size_t AnalysisCache::EMPTY_SLOT;
+const size_t AnalysisCache::INITIAL_SLOTS;
+
+AnalysisCache::AnalysisCache(size_t size):
+  capacity(size),
+  hand(0)
 {
-  if (i >= TRANSITION_TARGET_TABLE_START) 
-    {
-      return transitions[i - TRANSITION_TARGET_TABLE_START]->final();
-    }
-  else
+  // the slots are added as the cache fills, so a large one costs nothing
+  // up front
+  slots.resize(INITIAL_SLOTS, EMPTY_SLOT);
+}
+
+size_t AnalysisCache::hash_input(const char * input, size_t length)
+{ // FNV-1a
+  size_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i)
     {
-      return transitions[i]->final();
+      hash = (hash ^ (unsigned char)(input[i])) * 16777619u;
     }
+  return hash;
 }
 
-void Transducer::set_symbol_table(void)
+size_t AnalysisCache::find_slot(const char * input, size_t length,
+				size_t hash) const
 {
-  for(KeyTable::iterator it = keys->begin();
-      it != keys->end();
-      ++it)
+  size_t mask = slots.size() - 1;
+  size_t slot = hash & mask;
+  while (slots[slot] != EMPTY_SLOT)
     {
-      const char * key_name =
-	it->second;
-
-      symbol_table.push_back(key_name);
+      const Entry & entry = entries[slots[slot]];
+      if (entry.hash == hash && entry.input.size() == length &&
+	  memcmp(entry.input.data(), input, length) == 0)
+	{
+	  break;
+	}
+      slot = (slot + 1) & mask;
     }
+  return slot;
 }
 
-void Transducer::try_epsilon_transitions(SymbolNumber * input_symbol,
-					 SymbolNumber * output_symbol,
-					 SymbolNumber * original_output_string,
-					 TransitionTableIndex i)
+void AnalysisCache::grow_slots(void)
 {
-#if OL_FULL_DEBUG
-  std::cout << "try_epsilon_transitions " << i << std::endl;
-#endif
-  while (transitions[i]->get_input() == 0)
+  slots.assign(2 * slots.size(), EMPTY_SLOT);
+  size_t mask = slots.size() - 1;
+  for (size_t index = 0; index < entries.size(); ++index)
     {
-      *output_symbol = transitions[i]->get_output();
-      get_analyses(input_symbol,
-		   output_symbol+1,
-		   original_output_string,
-		   transitions[i]->target());
-      ++i;
+      size_t slot = entries[index].hash & mask;
+      while (slots[slot] != EMPTY_SLOT)
+	{
+	  slot = (slot + 1) & mask;
+	}
+      slots[slot] = index;
     }
 }
 
-void TransducerFd::try_epsilon_transitions(SymbolNumber * input_symbol,
-					 SymbolNumber * output_symbol,
-					 SymbolNumber * original_output_string,
-					 TransitionTableIndex i)
+void AnalysisCache::erase_slot(size_t slot)
 {
-#if OL_FULL_DEBUG
-  std::cout << "try_epsilon_transitions " << i << std::endl;
-#endif
-  
+  // Move back the entries after it that would no longer be found past
+  // the gap
+  size_t mask = slots.size() - 1;
+  size_t next = slot;
   while (true)
     {
-    if (transitions[i]->get_input() == 0) // epsilon
-	{
-	  *output_symbol = transitions[i]->get_output();
-	  get_analyses(input_symbol,
-		       output_symbol+1,
-		       original_output_string,
-		       transitions[i]->target());
-	  ++i;
-	} else if (transitions[i]->get_input() != NO_SYMBOL_NUMBER &&
-		   operations[transitions[i]->get_input()].isFlag())
+      next = (next + 1) & mask;
+      if (slots[next] == EMPTY_SLOT)
 	{
-	  if (PushState(operations[transitions[i]->get_input()]))
-	    {
-#if OL_FULL_DEBUG
-	      std::cout << "flag diacritic " <<
-		symbol_table[transitions[i]->get_input()] << " allowed\n";
-#endif
-	      // flag diacritic allowed
-	      *output_symbol = transitions[i]->get_output();
-	      get_analyses(input_symbol,
-			   output_symbol+1,
-			   original_output_string,
-			   transitions[i]->target());
-	      statestack.pop_back();
-	    }
-	  else
-	    {
-#if OL_FULL_DEBUG
-	      std::cout << "flag diacritic " <<
-		symbol_table[transitions[i]->get_input()] << " disallowed\n";
-#endif
-	    }
-	  ++i;
-	} else
+	  break;
+	}
+      size_t home = entries[slots[next]].hash & mask;
+      if (((next - home) & mask) >= ((next - slot) & mask))
 	{
-	  return;
+	  slots[slot] = slots[next];
+	  slot = next;
 	}
     }
+  slots[slot] = EMPTY_SLOT;
 }
 
-void Transducer::try_epsilon_indices(SymbolNumber * input_symbol,
-				     SymbolNumber * output_symbol,
-				     SymbolNumber * original_output_string,
-				     TransitionTableIndex i)
+const std::string * AnalysisCache::find(const char * input, size_t length)
 {
-#if OL_FULL_DEBUG
-  std::cout << "try_epsilon_indices " << i << std::endl;
-#endif
-  if (indices[i]->get_input() == 0)
+  size_t slot = find_slot(input, length, hash_input(input, length));
+  if (slots[slot] == EMPTY_SLOT)
     {
-      try_epsilon_transitions(input_symbol,
-			      output_symbol,
-			      original_output_string,
-			      indices[i]->target() - 
-			      TRANSITION_TARGET_TABLE_START);
+      return NULL;
     }
+  Entry & entry = entries[slots[slot]];
+  entry.referenced = true;
+  return &entry.output;
 }
 
-void Transducer::find_transitions(SymbolNumber input,
-				    SymbolNumber * input_symbol,
-				    SymbolNumber * output_symbol,
-				    SymbolNumber * original_output_string,
-				    TransitionTableIndex i)
+void AnalysisCache::insert(const char * input, size_t length,
+			   const char * output, size_t output_length)
 {
-#if OL_FULL_DEBUG
-  std::cout << "find_transitions " << i << "\t" << transitions[i]->get_input() << std::endl;
-#endif
-
-  while (transitions[i]->get_input() != NO_SYMBOL_NUMBER)
+  size_t hash = hash_input(input, length);
+  size_t index;
+  if (entries.size() < capacity)
     {
-      if (transitions[i]->get_input() == input)
+      // at most half the slots are used, so that probes stay short
+      if (entries.size() + 1 > slots.size() / 2)
 	{
-	  
-	  *output_symbol = transitions[i]->get_output();
-	  get_analyses(input_symbol,
-		       output_symbol+1,
-		       original_output_string,
-		       transitions[i]->target());
+	  grow_slots();
 	}
-      else
+      index = entries.size();
+      entries.push_back(Entry());
+    }
+  else
+    {
+      while (entries[hand].referenced)
 	{
-	  return;
+	  entries[hand].referenced = false;
+	  hand = (hand + 1) % capacity;
 	}
-      ++i;
-    }
+      index = hand;
+      hand = (hand + 1) % capacity;
+      Entry & old = entries[index];
+      erase_slot(find_slot(old.input.data(), old.input.size(), old.hash));
+    }
+  Entry & entry = entries[index];
+  entry.hash = hash;
+  entry.input.assign(input, length);
+  entry.output.assign(output, output_length);
+  entry.referenced = false;
+  slots[find_slot(input, length, hash)] = index;
 }
 
-void Transducer::find_index(SymbolNumber input,
-			    SymbolNumber * input_symbol,
-			    SymbolNumber * output_symbol,
-			    SymbolNumber * original_output_string,
-			    TransitionTableIndex i)
+static double seconds_now(void)
 {
-#if OL_FULL_DEBUG
-  std::cout << "find_index " << i << "\t" << indices[i+input]->get_input() << std::endl;
-#endif
-  if (indices[i+input]->get_input() == input)
-    {
-      find_transitions(input,
-		       input_symbol,
-		       output_symbol,
-		       original_output_string,
-		       indices[i+input]->target() - 
-		       TRANSITION_TARGET_TABLE_START);
-    }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-void Transducer::note_analysis(SymbolNumber * whole_output_string)
+// for --verbose, the time spent in tokenizing, lookup and output, and how
+// often the cache had the answer
+struct LookupTiming
 {
-  if (beFast)
+  unsigned long words;
+  unsigned long input_bytes;
+  unsigned long cache_lookups;
+  unsigned long cache_hits;
+  double encode_time;
+  double lookup_time;
+  double output_time;
+
+  LookupTiming(void):
+    words(0),
+    input_bytes(0),
+    cache_lookups(0),
+    cache_hits(0),
+    encode_time(0.0),
+    lookup_time(0.0),
+    output_time(0.0)
+  {}
+};
+
+// Look up one line of input and put its analyses in out
+template <class genericTransducer>
+static void analyze_line(genericTransducer & T,
+			 char * str,
+			 size_t length,
+			 SymbolNumberVector & input_symbols,
+			 OutputBuffer & out,
+			 LookupTiming & timing)
+{
+  if (echoInputsFlag)
     {
-      for (SymbolNumber * num = whole_output_string; *num != NO_SYMBOL_NUMBER; ++num)
+      out.put(str);
+      out.put('\n');
+    }
+  // every symbol takes at least one byte of the line
+  if (length >= input_symbols.size())
+    {
+      input_symbols.resize(std::max(length + 1, 2 * input_symbols.size()),
+			   NO_SYMBOL_NUMBER);
+    }
+  SymbolNumber * input_string = &input_symbols[0];
+  double start = timingFlag ? seconds_now() : 0.0;
+  bool encoded = T.encode(str, length, input_string);
+  if (timingFlag)
+    {
+      double now = seconds_now();
+      timing.encode_time += now - start;
+      timing.input_bytes += length;
+      start = now;
+    }
+  if (!encoded)
+    { // tokenization failed
+      if (echoInputsFlag)
 	{
-	  std::cout << symbol_table[*num];
+	  out.put('\n');
 	}
-      std::cout << std::endl;
-    } else
-    {
-      std::string str = "";
-      for (SymbolNumber * num = whole_output_string; *num != NO_SYMBOL_NUMBER; ++num)
+      if (outputType == xerox)
 	{
-	  str.append(symbol_table[*num]);
+	  out.put(str);
+	  out.put("\t+?\n\n", 5);
 	}
-      display_vector.push_back(str);
+      return;
     }
-}
-
-void TransducerUniq::note_analysis(SymbolNumber * whole_output_string)
-{
-  std::string str = "";
-  for (SymbolNumber * num = whole_output_string; *num != NO_SYMBOL_NUMBER; ++num)
+  T.set_output(out);
+  if (timingFlag)
     {
-      str.append(symbol_table[*num]);
+      T.analyze(input_string);
+      double analyzed = seconds_now();
+      T.printAnalyses(str);
+      timing.lookup_time += analyzed - start;
+      timing.output_time += seconds_now() - analyzed;
+      ++timing.words;
+      return;
     }
-  display_vector.insert(str);
+  T.analyze(input_string);
+  T.printAnalyses(str);
 }
 
-void TransducerFdUniq::note_analysis(SymbolNumber * whole_output_string)
+// The same, with the output taken from the cache if there is one
+template <class genericTransducer>
+static void lookup_line(genericTransducer & T,
+			char * str,
+			size_t length,
+			SymbolNumberVector & input_symbols,
+			AnalysisCache * cache,
+			OutputBuffer & out,
+			LookupTiming & timing)
 {
-  std::string str = "";
-  for (SymbolNumber * num = whole_output_string; *num != NO_SYMBOL_NUMBER; ++num)
+  if (cache == NULL)
     {
-      str.append(symbol_table[*num]);
+      analyze_line(T, str, length, input_symbols, out, timing);
+      return;
     }
-  display_vector.insert(str);
+  ++timing.cache_lookups;
+  const std::string * cached = cache->find(str, length);
+  if (cached != NULL)
+    {
+      ++timing.cache_hits;
+      out.put(*cached);
+      return;
+    }
+  cache->pending.clear();
+  analyze_line(T, str, length, input_symbols, cache->pending, timing);
+  cache->insert(str, length, cache->pending.data(), cache->pending.size());
+  out.put(cache->pending.data(), cache->pending.size());
 }
 
-void Transducer::get_analyses(SymbolNumber * input_symbol,
-			      SymbolNumber * output_symbol,
-			      SymbolNumber * original_output_string,
-			      TransitionTableIndex i)
+/*
+ * With --jobs, input is read in chunks of lines, a batch of them at a time.
+ * While the worker threads look up one batch, the main thread writes out
+ * the previous one and reads the next. Each chunk keeps its output until
+ * it's written, so the output comes in the same order as the input.
+ */
+struct LookupChunk
+{
+  static const size_t LINES = 256;
+  std::vector<char> text; // the lines, each NUL-terminated
+  std::vector<size_t> line_starts;
+  OutputBuffer output;
+};
+
+struct LookupBatch
 {
-#if OL_FULL_DEBUG
-  std::cout << "get_analyses " << i << std::endl;
-#endif
-  if (i >= TRANSITION_TARGET_TABLE_START )
-    {
-      i -= TRANSITION_TARGET_TABLE_START;
-      
-      try_epsilon_transitions(input_symbol,
-			      output_symbol,
-			      original_output_string,
-			      i+1);
+  std::vector<LookupChunk *> chunks;
+  size_t count; // how many chunks have input
+
+  LookupBatch(size_t size):
+    chunks(size),
+    count(0)
+  {
+    for (size_t i = 0; i < size; ++i)
+      {
+	chunks[i] = new LookupChunk;
+      }
+  }
 
-#if OL_FULL_DEBUG
-      std::cout << "Testing input string on transition side, " << *input_symbol << " at pointer" << std::endl;
-#endif
+  ~LookupBatch(void)
+  {
+    for (size_t i = 0; i < chunks.size(); ++i)
+      {
+	delete chunks[i];
+      }
+  }
 
-      // input-string ended.
-      if (*input_symbol == NO_SYMBOL_NUMBER)
-	{
-	  *output_symbol = NO_SYMBOL_NUMBER;
-	  if (final_transition(i))
-	    {
-	      note_analysis(original_output_string);
-	    }
-	  return;
-	}
-      
-      SymbolNumber input = *input_symbol;
-      ++input_symbol;
-      
-      find_transitions(input,
-		       input_symbol,
-		       output_symbol,
-		       original_output_string,
-		       i+1);
+  // Returns false at the end of input
+  bool read(InputBuffer & input)
+  {
+    count = 0;
+    for (; count < chunks.size(); ++count)
+      {
+	LookupChunk & chunk = *chunks[count];
+	chunk.text.clear();
+	chunk.line_starts.clear();
+	char * str;
+	size_t length;
+	while (chunk.line_starts.size() < LookupChunk::LINES &&
+	       (str = input.next_line(length)) != NULL)
+	  {
+	    chunk.line_starts.push_back(chunk.text.size());
+	    chunk.text.insert(chunk.text.end(), str, str + length + 1);
+	  }
+	if (chunk.line_starts.empty())
+	  {
+	    break;
+	  }
+      }
+    return count > 0;
+  }
+
+  void write(OutputBuffer & out)
+  {
+    for (size_t i = 0; i < count; ++i)
+      {
+	out.put(chunks[i]->output.data(), chunks[i]->output.size());
+	chunks[i]->output.clear();
+	out.end_input();
+      }
+    count = 0;
+  }
+};
+
+template <class genericTransducer>
+class LookupPool
+{
+ private:
+  struct Worker
+  {
+    genericTransducer * transducer;
+    SymbolNumberVector input_symbols;
+    AnalysisCache * cache;
+    LookupTiming timing;
+    pthread_t thread;
+    LookupPool * pool;
+  };
+
+  std::vector<Worker> workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  LookupBatch * batch;
+  unsigned long batch_number;
+  size_t next_chunk;
+  size_t busy_workers;
+  bool finished;
+
+  static void * work(void * w);
+
+ public:
+  LookupPool(size_t threads, const typename genericTransducer::Model & model);
+
+  ~LookupPool(void);
+
+  // Have the workers look up every chunk of b
+  void start(LookupBatch & b);
+
+  // Wait for them to finish
+  void wait(void);
+
+  LookupTiming timing(void) const;
+};
+
+template <class genericTransducer>
+LookupPool<genericTransducer>::LookupPool(size_t threads,
+					  const typename genericTransducer::Model & model):
+  workers(threads),
+  batch(NULL),
+  batch_number(0),
+  next_chunk(0),
+  busy_workers(0),
+  finished(false)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&work_ready, NULL);
+  pthread_cond_init(&work_done, NULL);
+  // the model is shared, everything a lookup changes is per worker
+  for (size_t i = 0; i < threads; ++i)
+    {
+      workers[i].transducer = new genericTransducer(model);
+      workers[i].cache = cacheSize > 0 ? new AnalysisCache(cacheSize) : NULL;
+      workers[i].input_symbols.resize(1000, NO_SYMBOL_NUMBER);
+      workers[i].pool = this;
     }
-  else
+  for (size_t i = 0; i < threads; ++i)
     {
-      
-      try_epsilon_indices(input_symbol,
-			  output_symbol,
-			  original_output_string,
-			  i+1);
-      
-#if OL_FULL_DEBUG
-      std::cout << "Testing input string on index side, " << *input_symbol << " at pointer" << std::endl;
-#endif
-      
-      if (*input_symbol == NO_SYMBOL_NUMBER)
-	{ // input-string ended.
-	  *output_symbol = NO_SYMBOL_NUMBER;
-	  if (final_index(i))
-	    {
-	      note_analysis(original_output_string);
-	    }
-	  return;
+      if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+	{
+	  std::cerr << "Could not start thread" << std::endl;
+	  exit(1);
 	}
-      
-      SymbolNumber input = *input_symbol;
-      ++input_symbol;
-
-      find_index(input,
-		 input_symbol,
-		 output_symbol,
-		 original_output_string,
-		 i+1);
     }
-  *output_symbol = NO_SYMBOL_NUMBER;
 }
 
-void Transducer::printAnalyses(std::string prepend)
+template <class genericTransducer>
+LookupPool<genericTransducer>::~LookupPool(void)
+{
+  pthread_mutex_lock(&lock);
+  finished = true;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&lock);
+  for (size_t i = 0; i < workers.size(); ++i)
+    {
+      pthread_join(workers[i].thread, NULL);
+      delete workers[i].transducer;
+      delete workers[i].cache;
+    }
+  pthread_cond_destroy(&work_done);
+  pthread_cond_destroy(&work_ready);
+  pthread_mutex_destroy(&lock);
+}
+
+template <class genericTransducer>
+void * LookupPool<genericTransducer>::work(void * w)
 {
-  if (!beFast)
+  Worker & worker = *static_cast<Worker *>(w);
+  LookupPool & pool = *worker.pool;
+  unsigned long done_batch = 0;
+  pthread_mutex_lock(&pool.lock);
+  while (true)
     {
-      if (outputType == xerox && display_vector.size() == 0)
+      while (pool.batch_number == done_batch && !pool.finished)
 	{
-	  std::cout << prepend << "\t+?" << std::endl;
-	  std::cout << std::endl;
-	  return;
+	  pthread_cond_wait(&pool.work_ready, &pool.lock);
+	}
+      if (pool.finished)
+	{
+	  break;
 	}
-      int i = 0;
-      DisplayVector::iterator it = display_vector.begin();
-      while ( (it != display_vector.end()) && i < maxAnalyses )
+      done_batch = pool.batch_number;
+      while (pool.next_chunk < pool.batch->count)
 	{
-	  if (outputType == xerox)
+	  LookupChunk & chunk = *pool.batch->chunks[pool.next_chunk];
+	  ++pool.next_chunk;
+	  pthread_mutex_unlock(&pool.lock);
+	  for (size_t i = 0; i < chunk.line_starts.size(); ++i)
 	    {
-	      std::cout << prepend << "\t";
+	      char * str = &chunk.text[chunk.line_starts[i]];
+	      size_t end = i + 1 < chunk.line_starts.size() ?
+		chunk.line_starts[i + 1] : chunk.text.size();
+	      lookup_line(*worker.transducer, str, end - chunk.line_starts[i] - 1,
+			  worker.input_symbols, worker.cache, chunk.output,
+			  worker.timing);
 	    }
-	  std::cout << *it << std::endl;
-	  ++it;
-	  ++i;
+	  pthread_mutex_lock(&pool.lock);
+	}
+      if (--pool.busy_workers == 0)
+	{
+	  pthread_cond_signal(&pool.work_done);
 	}
-      display_vector.clear(); // purge the display vector
-      std::cout << std::endl;
     }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
 }
 
-void TransducerUniq::printAnalyses(std::string prepend)
+template <class genericTransducer>
+void LookupPool<genericTransducer>::start(LookupBatch & b)
 {
-  if (outputType == xerox && display_vector.size() == 0)
-    {
-      std::cout << prepend << "\t+?" << std::endl;
-      std::cout << std::endl;
-      return;
-    }
-  int i = 0;
-  DisplaySet::iterator it = display_vector.begin();
-  while ( (it != display_vector.end()) && i < maxAnalyses)
+  pthread_mutex_lock(&lock);
+  batch = &b;
+  ++batch_number;
+  next_chunk = 0;
+  busy_workers = workers.size();
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&lock);
+}
+
+template <class genericTransducer>
+void LookupPool<genericTransducer>::wait(void)
+{
+  pthread_mutex_lock(&lock);
+  while (busy_workers > 0)
     {
-      if (outputType == xerox)
-	{
-	  std::cout << prepend << "\t";
-	}
-      std::cout << *it << std::endl;
-      ++it;
-      ++i;
+      pthread_cond_wait(&work_done, &lock);
     }
-  display_vector.clear(); // purge the display set
-  std::cout << std::endl;
+  pthread_mutex_unlock(&lock);
+}
+
+template <class genericTransducer>
+LookupTiming LookupPool<genericTransducer>::timing(void) const
+{
+  LookupTiming total;
+  for (size_t i = 0; i < workers.size(); ++i)
+    {
+      total.words += workers[i].timing.words;
+      total.input_bytes += workers[i].timing.input_bytes;
+      total.cache_lookups += workers[i].timing.cache_lookups;
+      total.cache_hits += workers[i].timing.cache_hits;
+      total.encode_time += workers[i].timing.encode_time;
+      total.lookup_time += workers[i].timing.lookup_time;
+      total.output_time += workers[i].timing.output_time;
+    }
+  return total;
+}
+
+template <class genericTransducer>
+static LookupTiming run_threads(const typename genericTransducer::Model & model)
+{
+  LookupPool<genericTransducer> pool(threadCount, model);
+  InputBuffer input;
+  // a few chunks for each thread, so that they finish close together
+  LookupBatch first(4 * threadCount);
+  LookupBatch second(4 * threadCount);
+  LookupBatch * current = &first;
+  LookupBatch * previous = &second;
+  current->read(input);
+  while (current->count > 0)
+    {
+      pool.start(*current);
+      previous->write(output);
+      previous->read(input);
+      pool.wait();
+      std::swap(current, previous);
+    }
+  previous->write(output);
+  return pool.timing();
 }
 
-void TransducerFdUniq::printAnalyses(std::string prepend)
+template <class genericTransducer>
+void runTransducer(const char * tables,
+		   TransducerHeader & header,
+		   TransducerAlphabet & alphabet)
 {
-  if (outputType == xerox && display_vector.size() == 0)
+  typename genericTransducer::Model model(tables, header, alphabet);
+  LookupTiming timing;
+  if (threadCount > 1)
     {
-      std::cout << prepend << "\t+?" << std::endl;
-      std::cout << std::endl;
-      return;
+      timing = run_threads<genericTransducer>(model);
     }
-  int i = 0;
-  DisplaySet::iterator it = display_vector.begin();
-  while ( (it != display_vector.end()) && i < maxAnalyses)
+  else
     {
-      if (outputType == xerox)
+      genericTransducer T(model);
+      InputBuffer input;
+      SymbolNumberVector input_symbols(1000, NO_SYMBOL_NUMBER);
+      AnalysisCache * cache = cacheSize > 0 ? new AnalysisCache(cacheSize) : NULL;
+      char * str;
+      size_t length;
+      while ((str = input.next_line(length)) != NULL)
 	{
-	  std::cout << prepend << "\t";
+	  lookup_line(T, str, length, input_symbols, cache, output, timing);
+	  output.end_input();
 	}
-      std::cout << *it << std::endl;
-      ++it;
-      ++i;
+      delete cache;
     }
-  display_vector.clear(); // purge the display set
-  std::cout << std::endl;
-}
-
-/**
- * BEGIN old transducer-weighted.cc
- */
-
-bool TransitionWIndex::matches(SymbolNumber s)
-{
-  
-  if (input_symbol == NO_SYMBOL_NUMBER)
+  output.flush();
+  if (timingFlag && timing.words > 0)
     {
-      return false;
+      std::cerr << timing.words << " inputs looked up in "
+		<< timing.lookup_time << " s ("
+		<< (timing.lookup_time * 1e9 / timing.words)
+		<< " ns each), output took " << timing.output_time << " s ("
+		<< (timing.output_time * 1e9 / timing.words)
+		<< " ns each), tokenizing took " << timing.encode_time << " s ("
+		<< (timing.input_bytes / 1e6 / timing.encode_time)
+		<< " MB/s)" << std::endl;
     }
-  if (s == NO_SYMBOL_NUMBER)
+  if (verboseFlag && timing.cache_lookups > 0)
     {
-      return true;
+      std::cerr << timing.cache_hits << " of " << timing.cache_lookups
+		<< " inputs were found in the cache ("
+		<< (100.0 * timing.cache_hits / timing.cache_lookups)
+		<< " %)" << std::endl;
     }
-  return input_symbol == s;
 }
 
-bool TransitionW::matches(SymbolNumber s)
+int setup(FILE * f)
 {
+  TransducerHeader header(f);
+  TransducerAlphabet alphabet(f, header.symbol_count());
+
+  if (verboseFlag && (header.probe_flag(Has_unweighted_input_epsilon_cycles) ||
+		      header.probe_flag(Has_input_epsilon_cycles)))
+    {
+      std::cerr << "Transducer has epsilon cycles, paths going round them are "
+		<< "cut off" << std::endl;
+    }
   
-  if (input_symbol == NO_SYMBOL_NUMBER)
+  size_t tables_size;
+  if (header.probe_flag(Weighted))
     {
-      return false;
+      tables_size = IndexTableReader<TransitionWIndex>::table_size(header.index_table_size()) +
+	TransitionTableReader<TransitionW>::table_size(header.target_table_size());
     }
-  if (s == NO_SYMBOL_NUMBER)
+  else
     {
-      return true;
+      tables_size = IndexTableReader<TransitionIndex>::table_size(header.index_table_size()) +
+	TransitionTableReader<Transition>::table_size(header.target_table_size());
     }
-  return input_symbol == s;
+  TransducerTables tables(f, tables_size, mmapTransducerFlag);
+  
+  if (alphabet.get_state_size() == 0)
+    {      // if the state size is zero, there are no flag diacritics to handle
+      if (header.probe_flag(Weighted) == false)
+	{
+	  if (displayUniqueFlag)
+	    { // no flags, no weights, unique analyses only
+	      runTransducer<Transducer<NoWeights, NoFlags, UniqueAnalyses> >(tables.get(), header, alphabet);
+	    } else
+	    { // no flags, no weights, all analyses
+	      runTransducer<Transducer<NoWeights, NoFlags, AllAnalyses> >(tables.get(), header, alphabet);
+	    }
+	}
+      else
+	{
+	  if (displayUniqueFlag)
+	    { // no flags, weights, unique analyses only
+	      runTransducer<Transducer<TropicalWeights, NoFlags, UniqueAnalyses> >(tables.get(), header, alphabet);
+	    } else
+	    { // no flags, weights, all analyses
+	      runTransducer<Transducer<TropicalWeights, NoFlags, AllAnalyses> >(tables.get(), header, alphabet);
+	    }
+	}
+    } else // handle flag diacritics
+    {
+      if (header.probe_flag(Weighted) == false)
+	{
+	  if (displayUniqueFlag)
+	    { // flags, no weights, unique analyses only
+	      runTransducer<Transducer<NoWeights, FlagDiacritics, UniqueAnalyses> >(tables.get(), header, alphabet);
+	    } else
+	    { // flags, no weights, all analyses
+	      runTransducer<Transducer<NoWeights, FlagDiacritics, AllAnalyses> >(tables.get(), header, alphabet);
+	    }
+	}
+      else
+	{
+	  if (displayUniqueFlag)
+	    { // flags, weights, unique analyses only
+	      runTransducer<Transducer<TropicalWeights, FlagDiacritics, UniqueAnalyses> >(tables.get(), header, alphabet);
+	    } else
+	    { // flags, weights, all analyses
+	      runTransducer<Transducer<TropicalWeights, FlagDiacritics, AllAnalyses> >(tables.get(), header, alphabet);
+	    }
+	}
+    }
+  return 0;
 }
 
-bool TransducerWFd::PushState(FlagDiacriticOperation op)
+/**
+ * BEGIN old transducer.cc
+ */
+
+bool FlagDiacritics::unchanged_since(size_t mark) const
 {
+  // each feature changed since is compared with the value it had first
+  for (size_t i = mark; i < undo_log.size(); ++i)
+    {
+      SymbolNumber feature = undo_log[i].first;
+      bool changed_before = false;
+      for (size_t j = mark; j < i && !changed_before; ++j)
+	{
+	  changed_before = undo_log[j].first == feature;
+	}
+      if (!changed_before && state[feature] != undo_log[i].second)
+	{
+	  return false;
+	}
+    }
+  return true;
+}
+
+bool FlagDiacritics::push_state(SymbolNumber s)
+{ // try to alter the flag diacritic state
+  const FlagDiacriticOperation & op = operations[s];
+  const ValueNumber current = state[op.Feature()];
   switch (op.Operation()) {
   case P: // positive set
-    statestack.push_back(statestack.back());
-    statestack.back()[op.Feature()] = op.Value();
-    return true;
+    return change(op.Feature(), op.Value());
   case N: // negative set (literally, in this implementation)
-    statestack.push_back(statestack.back());
-    statestack.back()[op.Feature()] = -1*op.Value();
-    return true;
+    return change(op.Feature(), -1*op.Value());
   case R: // require
     if (op.Value() == 0) // empty require
       {
-	if (statestack.back()[op.Feature()] == 0)
+	if (current == 0)
 	  {
 	    return false;
 	  }
-	statestack.push_back(statestack.back());
-	return true;
+	return change(op.Feature(), current);
       }
-    if (statestack.back()[op.Feature()] == op.Value())
+    if (current == op.Value())
       {
-	statestack.push_back(statestack.back());
-	return true;
+	return change(op.Feature(), current);
       }
     return false;
   case D: // disallow
     if (op.Value() == 0) // empty disallow
       {
-	if (statestack.back()[op.Feature()] != 0)
+	if (current != 0)
 	  {
 	    return false;
 	  }
-	else
-	  {
-	    statestack.push_back(statestack.back());
-	    return true;
-	  }
+	return change(op.Feature(), current);
       }
-    if (statestack.back()[op.Feature()] == op.Value()) // nonempty disallow
+    if (current == op.Value()) // nonempty disallow
       {
 	return false;
       }
-    statestack.push_back(statestack.back());
-    return true;
+    return change(op.Feature(), current);
   case C: // clear
-    statestack.push_back(statestack.back());
-    statestack.back()[op.Feature()] = 0;
-    return true;
+    return change(op.Feature(), 0);
   case U: // unification
-    if (statestack.back()[op.Feature()] == 0 || // if the feature is unset or
-	statestack.back()[op.Feature()] == op.Value() || // the feature is at this value already or
-	(statestack.back()[op.Feature()] < 0 &&
-	 (statestack.back()[op.Feature()] * -1 != op.Value())) // the feature is negatively set to something else
+    if (current == 0 || // if the feature is unset or
+	current == op.Value() || // the feature is at this value already or
+	(current < 0 &&
+	 (current * -1 != op.Value())) // the feature is negatively set to something else
 	)
       {
-	statestack.push_back(statestack.back());
-	statestack.back()[op.Feature()] = op.Value();
-	return true;
+	return change(op.Feature(), op.Value());
       }
     return false;
   }
   throw; // for the compiler's peace of mind
 }
 
-void IndexTableReaderW::get_index_vector(void)
+template <class T>
+static bool lighter(const T & a, const T & b)
 {
-  for (size_t i = 0;
-       i < number_of_table_entries;
-       ++i)
+  return a.first < b.first;
+}
+
+// Stable, so that analyses of equal weight stay in the order they came in.
+// There are usually only a few, which insertion sorts without allocating.
+template <class T>
+static void sort_by_weight(std::vector<T> & analyses, size_t count)
+{
+  if (count > 16)
     {
-      size_t j = i * TransitionWIndex::SIZE;
-      SymbolNumber * input = (SymbolNumber*)(TableIndices + j);
-      TransitionTableIndex * index = 
-	(TransitionTableIndex*)(TableIndices + j + sizeof(SymbolNumber));
-      indices.push_back(new TransitionWIndex(*input,*index));
+      std::stable_sort(analyses.begin(), analyses.begin() + count, lighter<T>);
+      return;
+    }
+  for (size_t i = 1; i < count; ++i)
+    {
+      for (size_t j = i; j > 0 && analyses[j].first < analyses[j - 1].first; --j)
+	{
+	  std::swap(analyses[j], analyses[j - 1]);
+	}
     }
 }
 
-void TransitionTableReaderW::Set(TransitionTableIndex pos)
+SymbolSpan AnalysisArena::add(const SymbolNumber * output,
+			      const SymbolTable & printed,
+			      SymbolNumber tag)
 {
-  if (pos >= TRANSITION_TARGET_TABLE_START)
+  SymbolSpan span;
+  span.start = symbols.size();
+  for (const SymbolNumber * s = output; *s != NO_SYMBOL_NUMBER; ++s)
     {
-      position = pos - TRANSITION_TARGET_TABLE_START;
+      if (*printed[*s] != '\0')
+	{
+	  symbols.push_back(*s);
+	}
     }
-  else
+  if (tag != NO_SYMBOL_NUMBER)
     {
-      position = pos;
+      symbols.push_back(tag);
     }
+  span.length = symbols.size() - span.start;
+  return span;
 }
 
-void TransitionTableReaderW::get_transition_vector(void)
+int AnalysisArena::compare(const SymbolSpan & a, const SymbolSpan & b,
+			   const SymbolTable & symbol_table) const
 {
-  for (size_t i = 0; i < number_of_table_entries; ++i)
+  const SymbolNumber * s = at(a);
+  const SymbolNumber * s_end = s + a.length;
+  const SymbolNumber * t = at(b);
+  const SymbolNumber * t_end = t + b.length;
+  // The same symbols spell the same text
+  while (s != s_end && t != t_end && *s == *t)
     {
-      size_t j = i * TransitionW::SIZE;
-      SymbolNumber * input = (SymbolNumber*)(TableTransitions + j);
-      SymbolNumber * output = 
-	(SymbolNumber*)(TableTransitions + j + sizeof(SymbolNumber));
-      TransitionTableIndex * target = 
-	(TransitionTableIndex*)(TableTransitions + j + 2 * sizeof(SymbolNumber));
-      Weight * weight =
-	(Weight*)(TableTransitions + j + 2 * sizeof(SymbolNumber) + sizeof(TransitionTableIndex));
-      transitions.push_back(new TransitionW(*input,
-					    *output,
-					    *target,
-					    *weight));
-      
+      ++s;
+      ++t;
+    }
+  if (s == s_end && t == t_end)
+    {
+      return 0;
+    }
+  // but the same text may also be made of different symbols, so the rest
+  // goes byte by byte
+  const char * p = "";
+  const char * q = "";
+  while (true)
+    {
+      while (*p == '\0' && s != s_end)
+	{
+	  p = symbol_table[*s++];
+	}
+      while (*q == '\0' && t != t_end)
+	{
+	  q = symbol_table[*t++];
+	}
+      if (*p == '\0' || *q == '\0')
+	{ // a prefix comes first
+	  return (*p != '\0') - (*q != '\0');
+	}
+      if (*p != *q)
+	{
+	  return (unsigned char)(*p) < (unsigned char)(*q) ? -1 : 1;
+	}
+      ++p;
+      ++q;
     }
-  transitions.push_back(new TransitionW());
-  transitions.push_back(new TransitionW());
 }
 
-bool TransitionTableReaderW::Matches(SymbolNumber s)
+size_t AnalysisArena::hash(const SymbolSpan & span,
+			   const SymbolTable & symbol_table) const
 {
-  TransitionW * t = transitions[position];
-  return t->matches(s);
+  size_t hash = 2166136261u;
+  const SymbolNumber * s = at(span);
+  for (size_t i = 0; i < span.length; ++i)
+    {
+      for (const char * p = symbol_table[s[i]]; *p != '\0'; ++p)
+	{
+	  hash = (hash ^ (unsigned char)(*p)) * 16777619u;
+	}
+    }
+  return hash;
 }
 
-bool TransitionTableReaderW::get_finality(TransitionTableIndex i)
+static void print_analysis(OutputBuffer & out,
+			   const char * prepend,
+			   const AnalysisArena & arena,
+			   const SymbolSpan & analysis,
+			   const SymbolTable & symbol_table,
+			   Weight w,
+			   bool weighted)
 {
-  if (i >= TRANSITION_TARGET_TABLE_START) 
+  if (outputType == xerox)
     {
-      return transitions[i - TRANSITION_TARGET_TABLE_START]->final();
+      out.put(prepend);
+      out.put('\t');
     }
-  else
+  arena.print(out, analysis, symbol_table);
+  if (weighted && displayWeightsFlag)
     {
-      return transitions[i]->final();
+      out.put('\t');
+      out.put(w);
     }
+  out.put('\n');
 }
 
+void AllAnalyses::print(OutputBuffer & out, const char * prepend,
+			bool weighted, Weight max_weight)
+{
+  if (weighted)
+    {
+      sort_by_weight(display_vector, display_vector.size());
+    }
+  for (size_t i = 0; i < display_vector.size() && i < (size_t)(maxAnalyses); ++i)
+    {
+      if (weighted && display_vector[i].first > max_weight)
+	{ // so are the rest
+	  break;
+	}
+      print_analysis(out, prepend, arena, display_vector[i].second, symbol_table,
+		     display_vector[i].first, weighted);
+    }
+  display_vector.clear();
+  arena.clear();
+}
 
-void TransducerW::set_symbol_table(void)
+size_t UniqueAnalyses::find_slot(const SymbolSpan & span, size_t hash) const
 {
-  for(KeyTable::iterator it = keys->begin();
-      it != keys->end();
-      ++it)
+  size_t mask = slots.size() - 1;
+  for (size_t slot = hash & mask; ; slot = (slot + 1) & mask)
     {
-      const char * key_name =
-	it->second;
+      if (slots[slot].generation != generation)
+	{
+	  return slot;
+	}
+      size_t i = slots[slot].analysis;
+      if (hashes[i] == hash &&
+	  arena.compare(display_vector[i].second, span, symbol_table) == 0)
+	{
+	  return slot;
+	}
+    }
+}
 
-      symbol_table.push_back(key_name);
+void UniqueAnalyses::rehash(size_t slot_count)
+{
+  slots.assign(slot_count, Slot());
+  for (size_t i = 0; i < slots.size(); ++i)
+    {
+      slots[i].generation = 0;
+    }
+  generation = 1;
+  size_t mask = slots.size() - 1;
+  for (size_t i = 0; i < display_vector.size(); ++i)
+    {
+      size_t slot = hashes[i] & mask;
+      while (slots[slot].generation == generation)
+	{
+	  slot = (slot + 1) & mask;
+	}
+      slots[slot].generation = generation;
+      slots[slot].analysis = i;
     }
 }
 
-void TransducerW::try_epsilon_transitions(SymbolNumber * input_symbol,
-					  SymbolNumber * output_symbol,
-					  SymbolNumber * 
-					  original_output_string,
-					  TransitionTableIndex i)
+bool UniqueAnalyses::note(const SymbolNumber * output, const SymbolTable & printed,
+			  SymbolNumber tag, Weight w)
 {
-#if OL_FULL_DEBUG
-  std::cerr << "try epsilon transitions " << i << " " << current_weight << std::endl;
-#endif
+  SymbolSpan span = arena.add(output, printed, tag);
+  size_t hash = arena.hash(span, symbol_table);
+  size_t slot = find_slot(span, hash);
+  if (slots[slot].generation == generation)
+    {
+      arena.drop(span);
+      Weight & old = display_vector[slots[slot].analysis].first;
+      if (old > w)
+	{ // we've found a lower weight
+	  old = w;
+	}
+      return false;
+    }
+  slots[slot].generation = generation;
+  slots[slot].analysis = display_vector.size();
+  display_vector.push_back(DisplaySpan(w, span));
+  hashes.push_back(hash);
+  if (2 * display_vector.size() > slots.size())
+    {
+      rehash(2 * slots.size());
+    }
+  return true;
+}
 
-  if (transitions.size() <= i) 
+void UniqueAnalyses::print(OutputBuffer & out, const char * prepend,
+			   bool weighted, Weight max_weight)
+{
+  if (weighted)
     {
-      return;
+      sort_by_weight(display_vector, display_vector.size());
+    }
+  for (size_t i = 0; i < display_vector.size() && i < (size_t)(maxAnalyses); ++i)
+    {
+      if (weighted && display_vector[i].first > max_weight)
+	{ // so are the rest
+	  break;
+	}
+      print_analysis(out, prepend, arena, display_vector[i].second, symbol_table,
+		     display_vector[i].first, weighted);
+    }
+  display_vector.clear();
+  hashes.clear();
+  arena.clear();
+  if (++generation == 0)
+    { // the stamps have gone all the way round
+      rehash(slots.size());
     }
+}
 
-  while ((transitions[i] != NULL) and (transitions[i]->get_input() == 0))
+bool TransitionIndex::matches(SymbolNumber s) const
+{
+  
+  if (input_symbol == NO_SYMBOL_NUMBER)
+    {
+      return false;
+    }
+  if (s == NO_SYMBOL_NUMBER)
     {
-      *output_symbol = transitions[i]->get_output();
-      current_weight += transitions[i]->get_weight();
-      get_analyses(input_symbol,
-		   output_symbol+1,
-		   original_output_string,
-		   transitions[i]->target());
-      current_weight -= transitions[i]->get_weight();
-      ++i;
+      return true;
     }
-  *output_symbol = NO_SYMBOL_NUMBER;
+  return input_symbol == s;
 }
 
-void TransducerWFd::try_epsilon_transitions(SymbolNumber * input_symbol,
-					    SymbolNumber * output_symbol,
-					    SymbolNumber * 
-					    original_output_string,
-					    TransitionTableIndex i)
+bool Transition::matches(SymbolNumber s) const
 {
-  if (transitions.size() <= i)
-    { return; }
   
-  while (true)
+  if (input_symbol == NO_SYMBOL_NUMBER)
     {
-    if (transitions[i]->get_input() == 0) // epsilon
-	{
-	  *output_symbol = transitions[i]->get_output();
-	  current_weight += transitions[i]->get_weight();
-	  get_analyses(input_symbol,
-		       output_symbol+1,
-		       original_output_string,
-		       transitions[i]->target());
-	  current_weight -= transitions[i]->get_weight();
-	  ++i;
-	} else if (transitions[i]->get_input() != NO_SYMBOL_NUMBER &&
-		   operations[transitions[i]->get_input()].isFlag())
-	{
-	    if (PushState(operations[transitions[i]->get_input()]))
-	    {
-#if OL_FULL_DEBUG
-	      std::cout << "flag diacritic " <<
-		symbol_table[transitions[i]->get_input()] << " allowed\n";
-#endif
-	      // flag diacritic allowed
-	      *output_symbol = transitions[i]->get_output();
-	      current_weight += transitions[i]->get_weight();
-	      get_analyses(input_symbol,
-			   output_symbol+1,
-			   original_output_string,
-			   transitions[i]->target());
-	      current_weight -= transitions[i]->get_weight();
-	      statestack.pop_back();
-	    }
-	  else
-	    {
-#if OL_FULL_DEBUG
-	      std::cout << "flag diacritic " <<
-		symbol_table[transitions[i]->get_input()] << " disallowed\n";
-#endif
-	    }
-	  ++i;
-	} else
-	{
-	  return;
-	}
+      return false;
+    }
+  if (s == NO_SYMBOL_NUMBER)
+    {
+      return true;
     }
+  return input_symbol == s;
 }
 
-void TransducerW::try_epsilon_indices(SymbolNumber * input_symbol,
-				      SymbolNumber * output_symbol,
-				      SymbolNumber * original_output_string,
-				      TransitionTableIndex i)
+bool TransitionWIndex::matches(SymbolNumber s) const
 {
-#if OL_FULL_DEBUG
-  std::cerr << "try indices " << i << " " << current_weight << std::endl;
-#endif
-  if (indices[i]->get_input() == 0)
+  
+  if (input_symbol == NO_SYMBOL_NUMBER)
     {
-      try_epsilon_transitions(input_symbol,
-			      output_symbol,
-			      original_output_string,
-			      indices[i]->target() - 
-			      TRANSITION_TARGET_TABLE_START);
+      return false;
     }
+  if (s == NO_SYMBOL_NUMBER)
+    {
+      return true;
+    }
+  return input_symbol == s;
 }
 
-void TransducerW::find_transitions(SymbolNumber input,
-				   SymbolNumber * input_symbol,
-				   SymbolNumber * output_symbol,
-				   SymbolNumber * original_output_string,
-				   TransitionTableIndex i)
+bool TransitionW::matches(SymbolNumber s) const
+{
+  
+  if (input_symbol == NO_SYMBOL_NUMBER)
+    {
+      return false;
+    }
+  if (s == NO_SYMBOL_NUMBER)
+    {
+      return true;
+    }
+  return input_symbol == s;
+}
+
+template <class W, class F, class R>
+inline void Transducer<W, F, R>::enter_state(SymbolNumber * input_symbol,
+					     SymbolNumber * output_symbol,
+					     TransitionTableIndex i,
+					     Weight w)
 {
 #if OL_FULL_DEBUG
-  std::cerr << "find transitions " << i << " " << current_weight << std::endl;
+  std::cout << "enter_state " << i << std::endl;
 #endif
+  TraversalFrame & frame = frames[depth];
+  ++depth;
+  frame.input_symbol = input_symbol;
+  frame.output_symbol = output_symbol;
+  frame.state = i;
+  frame.weight = w;
+  frame.flag_taken = false;
+  frame.flag_mark = flags.mark();
+  frame.next = first_epsilon(i);
+  frame.phase = frame.next == NO_TABLE_INDEX ? // no epsilons to try
+    TraversalFrame::INPUT : TraversalFrame::EPSILONS;
+}
 
-  if (transitions.size() <= i) 
+template <class W, class F, class R>
+inline void Transducer<W, F, R>::take_transition(TransitionTableIndex i,
+						 bool flag,
+						 bool matched)
+{
+  if (depth == depth_limit && !grow_frames())
+    { // the path is too long to go any further
+      frames[depth - 1].next = i + 1;
+      if (flag)
+	{
+	  flags.pop_state();
+	}
+      return;
+    }
+  TraversalFrame & frame = frames[depth - 1];
+  frame.next = i + 1;
+  Weight weight = frame.weight;
+  if (W::weighted)
     {
+      weight += W::transition_weight(transitions[i]);
+    }
+  if ((W::weighted && weight > path_bound) ||
+      (check_cycles && !matched &&
+       revisits(transitions[i].target(), frame.input_symbol)))
+    { // the path is too heavy to go any further, or would go round a
+      // cycle
+      if (flag)
+	{
+	  flags.pop_state();
+	}
       return;
     }
-  while (transitions[i]->get_input() != NO_SYMBOL_NUMBER)
+  frame.taken = i;
+  frame.flag_taken = flag;
+  *frame.output_symbol = transitions[i].get_output();
+  enter_state(matched ? frame.input_symbol + 1 : frame.input_symbol,
+	      frame.output_symbol + 1,
+	      transitions[i].target(),
+	      weight);
+}
+
+template <class W, class F, class R>
+inline bool Transducer<W, F, R>::try_epsilons(void)
+{
+  TraversalFrame & frame = frames[depth - 1];
+  for (TransitionTableIndex i = frame.next; ; ++i)
     {
-      
-      if (transitions[i]->get_input() == input)
+      SymbolNumber input = transitions[i].get_input();
+      if (input == 0) // epsilon
 	{
-	  current_weight += transitions[i]->get_weight();
-	  *output_symbol = transitions[i]->get_output();
-	  get_analyses(input_symbol,
-		       output_symbol+1,
-		       original_output_string,
-		       transitions[i]->target());
-	  current_weight -= transitions[i]->get_weight();
+	  take_transition(i, false, false);
+	  return true;
 	}
-      else
+      if (!flags.is_flag(input))
 	{
-	  return;
+	  return false;
 	}
-      ++i;
+      if (flags.push_state(input))
+	{
+#if OL_FULL_DEBUG
+	  std::cout << "flag diacritic " <<
+	    symbol_table[input] << " allowed\n";
+#endif
+	  take_transition(i, true, false);
+	  return true;
+	}
+#if OL_FULL_DEBUG
+      std::cout << "flag diacritic " <<
+	symbol_table[input] << " disallowed\n";
+#endif
     }
-  
 }
 
-void TransducerW::find_index(SymbolNumber input,
-			     SymbolNumber * input_symbol,
-			     SymbolNumber * output_symbol,
-			     SymbolNumber * original_output_string,
-			     TransitionTableIndex i)
+template <class W, class F, class R>
+inline void Transducer<W, F, R>::leave_state(void)
 {
-#if OL_FULL_DEBUG
-  std::cerr << "find index " << i << " " << current_weight << std::endl;
-#endif
-  if (indices.size() <= i) 
+  --depth;
+  if (depth == 0)
     {
       return;
     }
-  
-  if (indices[i+input]->get_input() == input)
+  if (frames[depth - 1].flag_taken)
     {
-      
-      find_transitions(input,
-		       input_symbol,
-		       output_symbol,
-		       original_output_string,
-		       indices[i+input]->target() - 
-		       TRANSITION_TARGET_TABLE_START);
+      flags.pop_state();
     }
 }
 
-void TransducerW::note_analysis(SymbolNumber * whole_output_string)
+template <class W, class F, class R>
+bool Transducer<W, F, R>::grow_frames(void)
 {
-  std::string str = "";
-  for (SymbolNumber * num = whole_output_string;
-       *num != NO_SYMBOL_NUMBER;
-       ++num)
+  if (depth_limit == max_depth)
+    {
+      return false;
+    }
+  SymbolNumber * old_output = &output_string[0];
+  size_t size = std::min(max_depth, 2 * frames.size());
+  frames.resize(size);
+  output_string.resize(size, NO_SYMBOL_NUMBER);
+  // the frames on the stack point into the output tape
+  for (size_t k = 0; k < depth; ++k)
     {
-      str.append(symbol_table[*num]);
+      frames[k].output_symbol = &output_string[0] +
+	(frames[k].output_symbol - old_output);
     }
-  display_map.insert(std::pair<Weight, std::string>(current_weight, str));
+  depth_limit = size;
+  return true;
 }
 
-void TransducerWUniq::note_analysis(SymbolNumber * whole_output_string)
+template <class W, class F, class R>
+bool Transducer<W, F, R>::revisits(TransitionTableIndex state,
+				   const SymbolNumber * input_symbol) const
 {
-  std::string str = "";
-  for (SymbolNumber * num = whole_output_string;
-       *num != NO_SYMBOL_NUMBER;
-       ++num)
+  // the frames at the same input position are the topmost ones
+  for (size_t k = depth; k > 0 && frames[k - 1].input_symbol == input_symbol; --k)
     {
-      str.append(symbol_table[*num]);
-    }
-  if ((display_map.count(str) == 0) || (display_map[str] > current_weight))
-    { // if there isn't an entry yet or we've found a lower weight
-      display_map.insert(std::pair<std::string, Weight>(str, current_weight));
+      if (frames[k - 1].state == state &&
+	  flags.unchanged_since(frames[k - 1].flag_mark))
+	{
+	  return true;
+	}
     }
+  return false;
+}
+
+template <class W, class F, class R>
+inline TransitionTableIndex
+Transducer<W, F, R>::first_epsilon(TransitionTableIndex state)
+{
+  return first_match(state, 0);
 }
 
-void TransducerWFdUniq::note_analysis(SymbolNumber * whole_output_string)
+template <class W, class F, class R>
+inline TransitionTableIndex
+Transducer<W, F, R>::first_match(TransitionTableIndex state,
+				 SymbolNumber input)
 {
-  std::string str = "";
-  for (SymbolNumber * num = whole_output_string;
-       *num != NO_SYMBOL_NUMBER;
-       ++num)
+  if (state >= TRANSITION_TARGET_TABLE_START)
     {
-      str.append(symbol_table[*num]);
+      return state - TRANSITION_TARGET_TABLE_START + 1;
     }
-  if ((display_map.count(str) == 0) || (display_map[str] > current_weight))
-    { // if there isn't an entry yet or we've found a lower weight
-      display_map.insert(std::pair<std::string, Weight>(str, current_weight));
+  if (indices[state+1+input].get_input() == input)
+    {
+      return indices[state+1+input].target() -
+	TRANSITION_TARGET_TABLE_START;
     }
+  return NO_TABLE_INDEX;
 }
 
-void TransducerW::printAnalyses(std::string prepend)
+template <class W, class F, class R>
+inline void Transducer<W, F, R>::note_final(const TraversalFrame & frame)
 {
-  if (outputType == xerox && display_map.size() == 0)
+  Weight weight = frame.weight;
+  if (frame.state >= TRANSITION_TARGET_TABLE_START)
     {
-      std::cout << prepend << "\t+?" << std::endl;
-      std::cout << std::endl;
-      return;
+      TransitionTableIndex i = frame.state - TRANSITION_TARGET_TABLE_START;
+      if (!final_transition(i))
+	{
+	  return;
+	}
+      if (W::weighted)
+	{
+	  weight += W::transition_weight(transitions[i]);
+	}
     }
-  int i = 0;
-  DisplayMultiMap::iterator it = display_map.begin();
-  while ( (it != display_map.end()) && (i < maxAnalyses))
+  else
     {
-      if (outputType == xerox)
+      if (!final_index(frame.state))
 	{
-	  std::cout << prepend << "\t";
+	  return;
 	}
-      std::cout << (*it).second;
-      if (displayWeightsFlag)
+      if (W::weighted)
 	{
-	  std::cout << '\t' << (*it).first;
+	  weight += W::final_weight(indices[frame.state]);
+	}
+    }
+  if (!W::weighted || weight <= weight_bound)
+    {
+      bool new_analysis = note_analysis(&output_string[0], weight);
+      if (new_analysis)
+	{
+	  ++found;
+	}
+      if (W::weighted && bounding)
+	{
+	  tighten_bound(weight, new_analysis);
 	}
-      std::cout << std::endl;
-      ++it;
-      ++i;
     }
-  display_map.clear();
-  std::cout << std::endl;
 }
 
-void TransducerWUniq::printAnalyses(std::string prepend)
+template <class W, class F, class R>
+bool Transducer<W, F, R>::note_analysis(SymbolNumber * whole_output_string,
+					Weight w)
 {
-  if (outputType == xerox && display_map.size() == 0)
-    {
-      std::cout << prepend << "\t+?" << std::endl;
-      std::cout << std::endl;
-      return;
-    }
-  int i = 0;
-  std::multimap<Weight, std::string> weight_sorted_map;
-  DisplayMap::iterator it = display_map.begin();
-  while (it != display_map.end())
-    {
-      weight_sorted_map.insert(std::pair<Weight, std::string>((*it).second, (*it).first));
-      ++it;
-    }
-  std::multimap<Weight, std::string>::iterator display_it = weight_sorted_map.begin();
-  while ( (display_it != weight_sorted_map.end()) && (i < maxAnalyses))
-    {
-      if (outputType == xerox)
+  if (beFast && !R::unique && !W::weighted)
+    { // there is no ordering to wait for, so print right away
+      for (SymbolNumber * num = whole_output_string; *num != NO_SYMBOL_NUMBER; ++num)
 	{
-	  std::cout << prepend << "\t";
+	  out->put(symbol_table[*num]);
 	}
-      std::cout << (*display_it).second;
-      if (displayWeightsFlag)
+      if (outputProjection == LEMMA_POS)
 	{
-	  std::cout << '\t' << (*display_it).first;
+	  SymbolNumber pos = model.part_of_speech(whole_output_string);
+	  if (pos != NO_SYMBOL_NUMBER)
+	    {
+	      out->put(model.symbols()[pos]);
+	    }
 	}
-      std::cout << std::endl;
-      ++display_it;
-      ++i;
+      out->put('\n');
+      return true;
     }
-  display_map.clear();
-  std::cout << std::endl;
+  SymbolNumber pos = outputProjection == LEMMA_POS ?
+    model.part_of_speech(whole_output_string) : NO_SYMBOL_NUMBER;
+  return results.note(whole_output_string, symbol_table, pos, w);
 }
 
-void TransducerWFdUniq::printAnalyses(std::string prepend)
+template <class W, class F, class R>
+void Transducer<W, F, R>::tighten_bound(Weight w, bool new_analysis)
 {
-  if (outputType == xerox && display_map.size() == 0)
-    {
-      std::cout << prepend << "\t+?" << std::endl;
-      std::cout << std::endl;
-      return;
-    }
-  int i = 0;
-  std::multimap<Weight, std::string> weight_sorted_map;
-  DisplayMap::iterator it;
-  for (it = display_map.begin(); it != display_map.end(); it++)
+  if (w + beamWidth < weight_bound)
     {
-      weight_sorted_map.insert(std::pair<Weight, std::string>((*it).second, (*it).first));
+      weight_bound = w + beamWidth;
     }
-  std::multimap<Weight, std::string>::iterator display_it;
-  for (display_it = weight_sorted_map.begin();
-       display_it != weight_sorted_map.end(), i < maxAnalyses;
-       display_it++, i++)
+  // An analysis found again with a lower weight keeps its old weight here,
+  // which only leaves the bound looser than it could be
+  if (new_analysis && maxAnalyses < INT_MAX)
     {
-      if (outputType == xerox)
+      best_weights.push_back(w);
+      std::push_heap(best_weights.begin(), best_weights.end());
+      if (best_weights.size() > static_cast<size_t>(maxAnalyses))
 	{
-	  std::cout << prepend << "\t";
+	  std::pop_heap(best_weights.begin(), best_weights.end());
+	  best_weights.pop_back();
 	}
-      std::cout << (*display_it).second;
-      if (displayWeightsFlag)
+      if (best_weights.size() == static_cast<size_t>(maxAnalyses) &&
+	  best_weights.front() < weight_bound)
 	{
-	  std::cout << '\t' << (*display_it).first;
+	  weight_bound = best_weights.front();
 	}
-      std::cout << std::endl;
     }
-  display_map.clear();
-  std::cout << std::endl;
+  if (pruning)
+    {
+      path_bound = weight_bound;
+    }
 }
 
-void TransducerW::get_analyses(SymbolNumber * input_symbol,
-			       SymbolNumber * output_symbol,
-			       SymbolNumber * original_output_string,
-			       TransitionTableIndex i)
+template <class W, class F, class R>
+void Transducer<W, F, R>::get_analyses(SymbolNumber * input_symbol,
+				       SymbolNumber * output_symbol,
+				       TransitionTableIndex i)
 {
-#if OL_FULL_DEBUG
-  std::cerr << "get analyses " << i << " " << current_weight << std::endl;
-#endif
-  if (i >= TRANSITION_TARGET_TABLE_START )
-    {
-      i -= TRANSITION_TARGET_TABLE_START;
-      
-      try_epsilon_transitions(input_symbol,
-			      output_symbol,
-			      original_output_string,
-			      i+1);
-      
-      // input-string ended.
-      if (*input_symbol == NO_SYMBOL_NUMBER)
+  // Each frame first follows the epsilons and flag diacritics out of its
+  // state, then either notes the analysis if the input has ended or
+  // follows the transitions matching the next input symbol. Children are
+  // visited in the same order the recursive lookup used to visit them.
+  depth = 0;
+  enter_state(input_symbol, output_symbol, i, 0.0);
+  while (depth > 0)
+    {
+      TraversalFrame & frame = frames[depth - 1];
+      switch (frame.phase)
 	{
-	  *output_symbol = NO_SYMBOL_NUMBER;
-	  if (transitions.size() <= i) 
+	case TraversalFrame::EPSILONS:
+	  if (try_epsilons())
 	    {
-	      return;
+	      break;
+	    }
+	  frame.phase = TraversalFrame::INPUT;
+	  // fall through
+	case TraversalFrame::INPUT:
+	  if (*frame.input_symbol == NO_SYMBOL_NUMBER)
+	    { // input-string ended.
+	      *frame.output_symbol = NO_SYMBOL_NUMBER;
+	      note_final(frame);
+	      leave_state();
+	      if (found == static_cast<unsigned long>(searchLimit))
+		{ // give up on the rest
+		  while (depth > 0)
+		    {
+		      leave_state();
+		    }
+		}
+	      break;
 	    }
-	  if (final_transition(i))
+	  frame.next = first_match(frame.state, *frame.input_symbol);
+	  if (frame.next == NO_TABLE_INDEX)
 	    {
-	      current_weight += get_final_transition_weight(i);
-	      note_analysis(original_output_string);
-	      current_weight -= get_final_transition_weight(i);
+	      leave_state();
+	      break;
 	    }
-	  return;
-	}
-      
-      SymbolNumber input = *input_symbol;
-      ++input_symbol;
-      
-      
-      find_transitions(input,
-		       input_symbol,
-		       output_symbol,
-		       original_output_string,
-		       i+1);
-    }
-  else
-    {
-      
-      try_epsilon_indices(input_symbol,
-			  output_symbol,
-			  original_output_string,
-			  i+1);
-      // input-string ended.
-      if (*input_symbol == NO_SYMBOL_NUMBER)
-	{
-	  *output_symbol = NO_SYMBOL_NUMBER;
-	  if (final_index(i))
+	  frame.phase = TraversalFrame::MATCHES;
+	  // fall through
+	case TraversalFrame::MATCHES:
+	  if (transitions[frame.next].get_input() == *frame.input_symbol)
 	    {
-	      current_weight += get_final_index_weight(i);
-	      note_analysis(original_output_string);
-	      current_weight -= get_final_index_weight(i);
+	      take_transition(frame.next, false, true);
 	    }
-	  return;
+	  else
+	    {
+	      leave_state();
+	    }
+	  break;
 	}
-      
-      SymbolNumber input = *input_symbol;
-      ++input_symbol;
-      
-      find_index(input,
-		 input_symbol,
-		 output_symbol,
-		 original_output_string,
-		 i+1);
     }
 }
 
+template <class W, class F, class R>
+void Transducer<W, F, R>::analyze(SymbolNumber * input_string)
+{
+  // Only the n best analyses, those within the beam of the best one and
+  // those under the maximum weight are wanted, so once some have been
+  // found the paths heavier than the bound need not be gone through
+  weight_bound = maxWeight;
+  bounding = W::weighted &&
+    (maxAnalyses < INT_MAX || beamWidth < std::numeric_limits<Weight>::infinity());
+  pruning = W::weighted &&
+    (bounding || maxWeight < std::numeric_limits<Weight>::infinity()) &&
+    model.weights_are_nonnegative();
+  path_bound = pruning ? weight_bound : std::numeric_limits<Weight>::infinity();
+  best_weights.clear();
+  size_t input_length = 0;
+  while (input_string[input_length] != NO_SYMBOL_NUMBER)
+    {
+      ++input_length;
+    }
+  max_depth = input_length + maxEpsilons + 1;
+  depth_limit = std::min(max_depth, frames.size());
+  found = 0;
+  get_analyses(input_string,&output_string[0],START_INDEX);
+}
+
+template <class W, class F, class R>
+void Transducer<W, F, R>::printAnalyses(const char * prepend)
+{
+  if (beFast && !R::unique && !W::weighted)
+    { // already printed by note_analysis()
+      return;
+    }
+  if (outputType == xerox && results.empty())
+    {
+      out->put(prepend);
+      out->put("\t+?\n\n", 5);
+      return;
+    }
+  results.print(*out, prepend, W::weighted, weight_bound);
+  out->put('\n');
+}
@@ -23,7 +23,9 @@
  */
 
 #include <getopt.h>
+#include <pthread.h>
 #include <cstdio>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <set>
@@ -31,8 +33,13 @@
 #include <climits>
 #include <cstring>
 #include <cassert>
+#include <cerrno>
 #include <ctime>
 #include <iostream>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -43,17 +50,27 @@
 enum OutputType {HFST, xerox};
 OutputType outputType = xerox;
 
+// Which symbols of an analysis are printed: all of them, the lemma, the
+// lemma and its part of speech, or the tags
+enum OutputProjection {FULL, LEMMA, LEMMA_POS, TAGS};
+OutputProjection outputProjection = FULL;
+
 bool verboseFlag = false;
 
 bool displayWeightsFlag = false;
 bool displayUniqueFlag = false;
 bool echoInputsFlag = false;
 bool beFast = false;
+bool mmapTransducerFlag = false;
 int maxAnalyses = INT_MAX;
+int searchLimit = INT_MAX;
+size_t maxEpsilons = 1000;
+int threadCount = 1;
+size_t cacheSize = 0;
+float maxWeight = std::numeric_limits<float>::infinity();
+float beamWidth = std::numeric_limits<float>::infinity();
 bool preserveDiacriticRepresentationsFlag = false;
 
-#define MAX_IO_STRING 5000
-
 // the following flags are only meaningful with certain debugging #defines
 bool timingFlag = false;
 bool printDebuggingInformationFlag = false;
@@ -83,9 +100,6 @@ enum HeaderFlag {Weighted, Deterministic, Input_deterministic, Minimized,
 		 Has_input_epsilon_transitions, Has_input_epsilon_cycles,
 		 Has_unweighted_input_epsilon_cycles};
 
-typedef std::vector<TransitionIndex*> TransitionIndexVector;
-typedef std::vector<Transition*> TransitionVector;
-
 // This is 2^31, hopefully equal to UINT_MAX/2 rounded up.
 // For some profound reason it can't be replaced with (UINT_MAX+1)/2.
 const TransitionTableIndex TRANSITION_TARGET_TABLE_START = 2147483648u;
@@ -172,15 +186,15 @@ class TransducerHeader
   SymbolNumber symbol_count(void)
   { return number_of_symbols; }
 
-  SymbolNumber input_symbol_count(void)
+  SymbolNumber input_symbol_count(void) const
   { return number_of_input_symbols; }
-  TransitionTableIndex index_table_size(void)
+  TransitionTableIndex index_table_size(void) const
   { return size_of_transition_index_table; }
 
-  TransitionTableIndex target_table_size(void)
+  TransitionTableIndex target_table_size(void) const
   { return size_of_transition_target_table; }
 
-  bool probe_flag(HeaderFlag flag)
+  bool probe_flag(HeaderFlag flag) const
   {
     switch (flag) {
     case Weighted: return weighted;
@@ -212,10 +226,10 @@ class FlagDiacriticOperation
  FlagDiacriticOperation():
   operation(P), feature(NO_SYMBOL_NUMBER), value(0) {}
   
-  bool isFlag(void) { return feature != NO_SYMBOL_NUMBER; }
-  FlagDiacriticOperator Operation(void) { return operation; }
-  SymbolNumber Feature(void) { return feature; }
-  ValueNumber Value(void) { return value; }
+  bool isFlag(void) const { return feature != NO_SYMBOL_NUMBER; }
+  FlagDiacriticOperator Operation(void) const { return operation; }
+  SymbolNumber Feature(void) const { return feature; }
+  ValueNumber Value(void) const { return value; }
 
 #if OL_FULL_DEBUG
   void print(void)
@@ -227,6 +241,13 @@ class FlagDiacriticOperation
 
 typedef std::vector<FlagDiacriticOperation> OperationVector;
 
+// What a symbol is for --project. Single characters are taken to spell the
+// lemma, and multicharacter symbols to be tags, except for flag diacritics
+// and boundaries like # and +#.
+enum SymbolClass {LEMMA_SYMBOL, TAG_SYMBOL, FLAG_SYMBOL, BOUNDARY_SYMBOL};
+
+SymbolClass classify_symbol(const char * symbol, bool flag);
+
 class TransducerAlphabet
 {
  private:
@@ -262,36 +283,48 @@ class TransducerAlphabet
 	free(line);
       }
   
-  KeyTable * get_key_table(void)
+  KeyTable * get_key_table(void) const
   { return kt; }
 
-  OperationVector get_operation_vector(void)
+  OperationVector get_operation_vector(void) const
+  { return operations; }
+
+  const OperationVector & get_operations(void) const
   { return operations; }
 
-  SymbolNumber get_state_size(void)
+  SymbolNumber get_state_size(void) const
   { return feature_bucket.size(); }
   
 };
 
-class LetterTrie;
-typedef std::vector<LetterTrie*> LetterTrieVector;
-
+/*
+ * The input symbols as a double-array trie. The node in cell s has its
+ * child on byte c in cell base + c, which is its child only if the check of
+ * that cell is s. The whole trie is a single array built once from the
+ * alphabet, so matching a symbol is a loop over it with no pointers to
+ * follow.
+ */
 class LetterTrie
 {
  private:
-  LetterTrieVector letters;
-  SymbolNumberVector symbols;
+  struct Cell
+  {
+    TransitionTableIndex base;
+    int check; // the parent cell, -1 if none
+    SymbolNumber symbol; // that ends here, if any
+  };
 
- public:
- LetterTrie(void):
-  letters(UCHAR_MAX, (LetterTrie*) NULL),
-    symbols(UCHAR_MAX,NO_SYMBOL_NUMBER)
-      {}
+  std::vector<Cell> cells;
 
-  void add_string(const char * p,SymbolNumber symbol_key);
+ public:
+  LetterTrie(void);
 
-  SymbolNumber find_key(char ** p);
+  // Build the trie of the symbols, each numbered by its place in symbols.
+  // Of equal strings the last one wins.
+  void build(const std::vector<const char *> & symbols);
 
+  // The longest symbol at *p, which is moved past it, or NO_SYMBOL_NUMBER
+  SymbolNumber find_key(char ** p) const;
 };
 
 class Encoder {
@@ -300,22 +333,78 @@ class Encoder {
   SymbolNumber number_of_input_symbols;
   LetterTrie letters;
   SymbolNumberVector ascii_symbols;
+  // Two-byte UTF-8 characters (such as all of Latin-1) that are symbols
+  // and no longer symbol starts with, by the low bits of both bytes
+  SymbolNumberVector utf8_symbols;
 
   void read_input_symbols(KeyTable * kt);
 
+  static bool is_utf8_pair(const unsigned char * p)
+  {
+    return p[0] >= 0xc2 && p[0] <= 0xdf && (p[1] & 0xc0) == 0x80;
+  }
+
+  static size_t utf8_pair_index(const unsigned char * p)
+  {
+    return ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+  }
+
+  // The next symbol at *s, moving *s past it
+  SymbolNumber next_symbol(const unsigned char ** s) const;
+
  public:
  Encoder(KeyTable * kt, SymbolNumber input_symbol_count):
   number_of_input_symbols(input_symbol_count),
-    ascii_symbols(UCHAR_MAX,NO_SYMBOL_NUMBER)
+    ascii_symbols(UCHAR_MAX + 1,NO_SYMBOL_NUMBER),
+    utf8_symbols(1 << 11, NO_SYMBOL_NUMBER)
       {
 	read_input_symbols(kt);
       }
   
-  SymbolNumber find_key(char ** p);
+  SymbolNumber find_key(char ** p) const;
+
+  // Tokenize the length bytes of str into symbols, ending them with
+  // NO_SYMBOL_NUMBER. Returns false if some of it isn't any symbol.
+  bool encode(char * str, size_t length, SymbolNumber * symbols) const;
 };
 
 typedef std::vector<ValueNumber> FlagDiacriticState;
-typedef std::vector<FlagDiacriticState> FlagDiacriticStateStack;
+// The value a feature had before a flag, to put back when leaving it
+typedef std::pair<SymbolNumber, ValueNumber> FlagDiacriticChange;
+typedef std::vector<FlagDiacriticChange> FlagDiacriticUndoLog;
+
+// The records of the tables are packed exactly as they are on disk, so that
+// the tables can be used in place as flat arrays whatever their alignment.
+#define PACKED_RECORD __attribute__((packed))
+
+// Room for two empty transitions (all bits set) after the transition table,
+// so that scanning off the end of a state always stops.
+const size_t TABLE_PADDING = 2 * (2 * sizeof(SymbolNumber) +
+				  sizeof(TransitionTableIndex) + sizeof(float));
+
+/*
+ * The index and transition tables, kept as the packed records they are
+ * stored as on disk. Lookup reads the records in place, so nothing is
+ * unpacked at load time. With --mmap the tables are mapped straight from
+ * the file, which makes startup nearly free and lets every process using
+ * the same transducer share its pages.
+ */
+class TransducerTables
+{
+ private:
+  char * tables;
+  void * mapping;
+  size_t mapping_size;
+
+  bool map_tables(FILE * f, size_t size);
+
+ public:
+  TransducerTables(FILE * f, size_t size, bool map);
+  ~TransducerTables();
+
+  const char * get(void)
+  { return tables; }
+};
 
 // GLOBAL FUNCTION, TODO: SUBSUME IN MAIN FOR SINGLE-FILE VERSION
 int setup(FILE * f);
@@ -324,361 +413,372 @@ int setup(FILE * f);
  * BEGIN old transducer.h
  */
 
-typedef std::vector<std::string> DisplayVector;
-typedef std::set<std::string> DisplaySet;
+typedef float Weight;
+const Weight INFINITE_WEIGHT = static_cast<float>(NO_TABLE_INDEX);
 
-class TransitionIndex
+/*
+ * Output collected in a buffer. Standard output is written out when the
+ * buffer fills up, after each input if it's a terminal, and at the end;
+ * going through std::cout with std::endl after every analysis made one
+ * write(2) for each. A buffer with no file to write just grows, to keep the
+ * output of a chunk of input until it can be written in order.
+ */
+class OutputBuffer
 {
- protected:
-  SymbolNumber input_symbol;
-  TransitionTableIndex first_transition_index;
-  
- public:
-  
-  // Each TransitionIndex has an input symbol and a target index.
-  static const size_t SIZE = 
-    sizeof(SymbolNumber) + sizeof(TransitionTableIndex);
+ private:
+  static const size_t BLOCK_SIZE = 1 << 16;
+  char * buffer;
+  size_t capacity;
+  size_t used;
+  int fd; // or -1 to keep everything
+  bool interactive;
 
- TransitionIndex(SymbolNumber input,
-		 TransitionTableIndex first_transition):
-    input_symbol(input),
-    first_transition_index(first_transition)
+  OutputBuffer(const OutputBuffer &);
+  OutputBuffer & operator=(const OutputBuffer &);
+
+  // Write out what's in the buffer, or make it bigger
+  void make_room(size_t n);
+
+  void write_out(const char * s, size_t n);
+
+ public:
+ OutputBuffer(int file = -1):
+  buffer(static_cast<char *>(malloc(BLOCK_SIZE))),
+    capacity(BLOCK_SIZE),
+    used(0),
+    fd(file),
+    interactive(file >= 0 && isatty(file))
     {}
 
-  bool matches(SymbolNumber s);
-  
-  TransitionTableIndex target(void)
+  ~OutputBuffer(void)
   {
-    return first_transition_index;
+    flush();
+    free(buffer);
   }
-  
-  bool final(void)
-  {
-    return first_transition_index == 1;
-  }
-  
-  SymbolNumber get_input(void)
+
+  void put(const char * s, size_t n)
   {
-    return input_symbol;
+    if (n > capacity - used)
+      {
+	make_room(n);
+	if (n > capacity - used)
+	  { // too much to buffer anyway
+	    write_out(s, n);
+	    return;
+	  }
+      }
+    memcpy(buffer + used, s, n);
+    used += n;
   }
-};
 
-class Transition
-{
- protected:
-  SymbolNumber input_symbol;
-  SymbolNumber output_symbol;
+  void put(const char * s)
+  { put(s, strlen(s)); }
 
-  TransitionTableIndex target_index;
+  void put(const std::string & s)
+  { put(s.data(), s.size()); }
 
- public:
+  void put(char c)
+  {
+    if (used == capacity)
+      {
+	make_room(1);
+      }
+    buffer[used++] = c;
+  }
 
-  // Each transition has an input symbol an output symbol and 
-  // a target index.
-  static const size_t SIZE = 
-    2 * sizeof(SymbolNumber) + sizeof(TransitionTableIndex);
+  // As std::cout would print it
+  void put(Weight w);
 
- Transition(SymbolNumber input,
-	    SymbolNumber output,
-	    TransitionTableIndex target):
-    input_symbol(input),
-    output_symbol(output),
-    target_index(target)
-    {}
+  const char * data(void) const
+  { return buffer; }
 
-  bool matches(SymbolNumber s);
+  size_t size(void) const
+  { return used; }
 
-  TransitionTableIndex target(void)
-  {
-    return target_index;
-  }
+  void clear(void)
+  { used = 0; }
 
-  SymbolNumber get_output(void)
+  // Every input's analyses have been put
+  void end_input(void)
   {
-    return output_symbol;
+    if (interactive)
+      {
+	flush();
+      }
   }
 
-  SymbolNumber get_input(void)
+  void flush(void)
   {
-    return input_symbol;
-  }
-  
-  bool final(void)
-  {
-    return target_index == 1;
+    if (fd < 0)
+      {
+	return;
+      }
+    size_t n = used;
+    used = 0;
+    write_out(buffer, n);
   }
 };
 
-class IndexTableReader
+OutputBuffer output(STDOUT_FILENO);
+
+/*
+ * Standard input, read in large blocks and split into lines in place. A
+ * line that doesn't fit in the buffer makes it grow, so there's no limit
+ * to the length of a line.
+ */
+class InputBuffer
 {
  private:
-  TransitionTableIndex number_of_table_entries;
-  char * TableIndices;
-  TransitionIndexVector indices;
-  size_t table_size;
-  
-  void get_index_vector(void);
+  static const size_t BLOCK_SIZE = 1 << 16;
+  char * buffer;
+  size_t capacity;
+  size_t start; // of the next line
+  size_t scanned; // up to here there's no newline after start
+  size_t end; // of what has been read
+  bool at_eof;
+
+  // Read another block after what is left of the current one
+  void fill(void);
+
  public:
- IndexTableReader(FILE * f,
-			 TransitionTableIndex index_count): 
-  number_of_table_entries(index_count)
-    {
-      table_size = number_of_table_entries*TransitionIndex::SIZE;
-      TableIndices = (char*)(malloc(table_size));
+ InputBuffer(void):
+  buffer(static_cast<char *>(malloc(BLOCK_SIZE + 1))),
+    capacity(BLOCK_SIZE + 1),
+    start(0),
+    scanned(0),
+    end(0),
+    at_eof(false)
+    {}
 
-      // This dummy variable is needed, since the compiler complains
-      // for not catching the return value of fread().
-      int dummy_number_of_bytes;
+  ~InputBuffer(void)
+  { free(buffer); }
 
-      dummy_number_of_bytes = fread(TableIndices,table_size,1,f);
-      get_index_vector();
-    }
-  
-  bool get_finality(TransitionTableIndex i)
-  {
-    return indices[i]->final();
-  }
-  
-  TransitionIndex * at(TransitionTableIndex i)
+  // The next line, NUL-terminated in place of its newline, or NULL at the
+  // end of input. It stays valid until the next call.
+  char * next_line(size_t & length)
   {
-    return indices[i];
+    while (true)
+      {
+	char * newline = static_cast<char *>
+	  (memchr(buffer + scanned, '\n', end - scanned));
+	char * line = buffer + start;
+	if (newline != NULL)
+	  {
+	    *newline = '\0';
+	    length = newline - line;
+	    start = scanned = newline - buffer + 1;
+	    return line;
+	  }
+	scanned = end;
+	if (at_eof)
+	  { // the last line may not end in a newline
+	    if (start == end)
+	      {
+		return NULL;
+	      }
+	    buffer[end] = '\0';
+	    length = end - start;
+	    start = scanned = end;
+	    return line;
+	  }
+	fill();
+      }
   }
-  
-  TransitionIndexVector &operator() (void)
-    { return indices; }
 };
 
-class TransitionTableReader
+/*
+ * With --cache-size, the output of recent inputs, so that common words are
+ * only looked up once. Inputs are found through an open-addressing hash
+ * table. When the cache is full, the entry to replace is chosen by CLOCK:
+ * the hand goes round the entries, sparing (once) those found since it last
+ * passed them.
+ */
+class AnalysisCache
 {
- protected:
-  TransitionTableIndex number_of_table_entries;
-  char * TableTransitions;
-  TransitionVector transitions;
-  size_t table_size;
-  size_t transition_size;
-  
-  TransitionTableIndex position;
-  
-  void get_transition_vector(void);
- public:
- TransitionTableReader(FILE * f,
-			      TransitionTableIndex transition_count):
-  number_of_table_entries(transition_count),
-    position(0)
-      {
-	table_size = number_of_table_entries*Transition::SIZE;
-	TableTransitions = (char*)(malloc(table_size));
-	int bytes;
-	bytes = fread(TableTransitions,table_size,1,f);
-	get_transition_vector();
+ private:
+  struct Entry
+  {
+    size_t hash;
+    std::string input;
+    std::string output;
+    bool referenced;
+  };
 
-      }
-  
-  void Set(TransitionTableIndex pos);
+  static const size_t EMPTY_SLOT = static_cast<size_t>(-1);
+  static const size_t INITIAL_SLOTS = 1024;
+  std::vector<Entry> entries;
+  std::vector<size_t> slots; // indices of entries, or EMPTY_SLOT
+  size_t capacity;
+  size_t hand;
 
-  Transition * at(TransitionTableIndex i)
-  {
-    return transitions[i - TRANSITION_TARGET_TABLE_START];
-  }
+  static size_t hash_input(const char * input, size_t length);
 
-  void Next(void)
-  {
-    ++position;
-  }
-  
-  bool Matches(SymbolNumber s);
+  // The slot holding the entry for input, or the empty one it would go in
+  size_t find_slot(const char * input, size_t length, size_t hash) const;
 
-  TransitionTableIndex get_target(void)
-  {
-    return transitions[position]->target();
-  }
+  void erase_slot(size_t slot);
 
-  SymbolNumber get_output(void)
-  {
-    return transitions[position]->get_output();
-  }
+  // Double the slots and put the entries in them again
+  void grow_slots(void);
 
-  SymbolNumber get_input(void)
-  {
-    return transitions[position]->get_input();
-  }
+ public:
+  // Where the output of an input that wasn't cached is put first
+  OutputBuffer pending;
 
-  bool get_finality(TransitionTableIndex i);
+  AnalysisCache(size_t size);
 
-  TransitionVector &operator() (void)
-    { 
-      return transitions; 
-    }
+  // The output of input, or NULL if it isn't cached
+  const std::string * find(const char * input, size_t length);
+
+  void insert(const char * input, size_t length,
+	      const char * output, size_t output_length);
 };
 
-class Transducer
+typedef std::vector<const char*> SymbolTable;
+
+// Where the symbols of an analysis are in an AnalysisArena
+struct SymbolSpan
 {
- protected:
-  TransducerHeader header;
-  TransducerAlphabet alphabet;
-  KeyTable * keys;
-  IndexTableReader index_reader;
-  TransitionTableReader transition_reader;
-  Encoder encoder;
-  DisplayVector display_vector;
+  size_t start;
+  size_t length;
+};
 
-  SymbolNumber * output_string;
+typedef std::pair<Weight, SymbolSpan> DisplaySpan;
+typedef std::vector<DisplaySpan> DisplaySpanVector;
 
-  static const TransitionTableIndex START_INDEX = 0;
-  
-  std::vector<const char*> symbol_table;
-  
-  TransitionIndexVector &indices;
-  
-  TransitionVector &transitions;
-  
-  void set_symbol_table(void);
+/*
+ * The analyses of one input, kept as the symbol numbers they are printed
+ * from, one after another in a single array that is emptied for the next
+ * input. Analyses are only made into text when they are printed, so the
+ * many that -n or -u leave out are never spelled out, and noting one
+ * allocates nothing once the array has grown to fit.
+ */
+class AnalysisArena
+{
+ private:
+  SymbolNumberVector symbols;
 
-  virtual void note_analysis(SymbolNumber * whole_output_string);
+ public:
+ AnalysisArena(void):
+  symbols()
+    {}
 
-  bool final_transition(TransitionTableIndex i)
-  {
-    return transitions[i]->final();
-  }
-  
-  bool final_index(TransitionTableIndex i)
-  {
-    return indices[i]->final();
-  }
-  
-  void try_epsilon_indices(SymbolNumber * input_symbol,
-			   SymbolNumber * output_symbol,
-			   SymbolNumber * original_output_string,
-			   TransitionTableIndex i);
-  
-  virtual void try_epsilon_transitions(SymbolNumber * input_symbol,
-			       SymbolNumber * output_symbol,
-			       SymbolNumber * original_output_string,
-			       TransitionTableIndex i);
-  
-  void find_index(SymbolNumber input,
-		  SymbolNumber * input_symbol,
-		  SymbolNumber * output_symbol,
-		  SymbolNumber * original_output_string,
-		  TransitionTableIndex i);
-  
-  void find_transitions(SymbolNumber input,
-			SymbolNumber * input_symbol,
-			SymbolNumber * output_symbol,
-			SymbolNumber * original_output_string,
-			TransitionTableIndex i);
-  
-  void get_analyses(SymbolNumber * input_symbol,
-			    SymbolNumber * output_symbol,
-			    SymbolNumber * original_output_string,
-			    TransitionTableIndex i);
+  // Copy in the symbols of output that print as something and then tag,
+  // if it's a symbol
+  SymbolSpan add(const SymbolNumber * output, const SymbolTable & printed,
+		 SymbolNumber tag);
 
+  // Forget the last span added
+  void drop(const SymbolSpan & span)
+  { symbols.resize(span.start); }
 
- public:
- Transducer(FILE * f, TransducerHeader h, TransducerAlphabet a):
-  header(h),
-    alphabet(a),
-    keys(alphabet.get_key_table()),
-    index_reader(f,header.index_table_size()),
-    transition_reader(f,header.target_table_size()),
-    encoder(keys,header.input_symbol_count()),
-    display_vector(),
-    output_string((SymbolNumber*)(malloc(2000))),
-    indices(index_reader()),
-    transitions(transition_reader())
-      {
-	for (int i = 0; i < 1000; ++i)
-	  {
-	    output_string[i] = NO_SYMBOL_NUMBER;
-	  }
-	set_symbol_table();
-      }
+  const SymbolNumber * at(const SymbolSpan & span) const
+  { return symbols.data() + span.start; }
 
-    
-  KeyTable * get_key_table(void)
-  {
-    return keys;
-  }
+  // Compare the text of two spans as strings compare, without making them
+  int compare(const SymbolSpan & a, const SymbolSpan & b,
+	      const SymbolTable & symbol_table) const;
 
-  SymbolNumber find_next_key(char ** p)
-  {
-    return encoder.find_key(p);
-  }
+  // A hash of the text of span, the same for all spans spelling it
+  size_t hash(const SymbolSpan & span, const SymbolTable & symbol_table) const;
 
-  void analyze(SymbolNumber * input_string)
+  void print(OutputBuffer & out, const SymbolSpan & span,
+	     const SymbolTable & symbol_table) const
   {
-    get_analyses(input_string,output_string,output_string,START_INDEX);
+    const SymbolNumber * s = at(span);
+    for (size_t i = 0; i < span.length; ++i)
+      {
+	out.put(symbol_table[s[i]]);
+      }
   }
 
-  virtual void printAnalyses(std::string prepend);
+  void clear(void)
+  { symbols.clear(); }
 };
 
-class TransducerUniq: public Transducer
+class PACKED_RECORD TransitionIndex
 {
- private:
-  DisplaySet display_vector;
-  void note_analysis(SymbolNumber * whole_output_string);
+ protected:
+  SymbolNumber input_symbol;
+  TransitionTableIndex first_transition_index;
+  
  public:
- TransducerUniq(FILE * f, TransducerHeader h, TransducerAlphabet a):
-  Transducer(f, h, a),
-    display_vector()
-      {}
   
-  void printAnalyses(std::string prepend);
-};
+  // Each TransitionIndex has an input symbol and a target index.
+  static const size_t SIZE = 
+    sizeof(SymbolNumber) + sizeof(TransitionTableIndex);
 
-class TransducerFd: public Transducer
-{
-  FlagDiacriticStateStack statestack;
-  OperationVector operations;
+ TransitionIndex(SymbolNumber input,
+		 TransitionTableIndex first_transition):
+    input_symbol(input),
+    first_transition_index(first_transition)
+    {}
 
-  void try_epsilon_transitions(SymbolNumber * input_symbol,
-			       SymbolNumber * output_symbol,
-			       SymbolNumber * original_output_string,
-			       TransitionTableIndex i);
+  bool matches(SymbolNumber s) const;
   
-  bool PushState(FlagDiacriticOperation op);
-
- public:
- TransducerFd(FILE * f, TransducerHeader h, TransducerAlphabet a):
-    Transducer(f, h, a),
-      statestack(1, FlagDiacriticState (a.get_state_size(), 0)),
-      operations(a.get_operation_vector())
-	{}
+  TransitionTableIndex target(void) const
+  {
+    return first_transition_index;
+  }
+  
+  bool final(void) const
+  {
+    return first_transition_index == 1;
+  }
+  
+  SymbolNumber get_input(void) const
+  {
+    return input_symbol;
+  }
 };
 
-class TransducerFdUniq: public TransducerFd
+class PACKED_RECORD Transition
 {
- private:
-  DisplaySet display_vector;
-  void note_analysis(SymbolNumber * whole_output_string);
+ protected:
+  SymbolNumber input_symbol;
+  SymbolNumber output_symbol;
+
+  TransitionTableIndex target_index;
+
  public:
- TransducerFdUniq(FILE * f, TransducerHeader h, TransducerAlphabet a):
-  TransducerFd(f, h, a),
-    display_vector()
-      {}
-  
-  void printAnalyses(std::string prepend);
 
-};
+  // Each transition has an input symbol an output symbol and 
+  // a target index.
+  static const size_t SIZE = 
+    2 * sizeof(SymbolNumber) + sizeof(TransitionTableIndex);
 
-/*
- * BEGIN old transducer-weighted.h
- */
+ Transition(SymbolNumber input,
+	    SymbolNumber output,
+	    TransitionTableIndex target):
+    input_symbol(input),
+    output_symbol(output),
+    target_index(target)
+    {}
 
-typedef float Weight;
-const Weight INFINITE_WEIGHT = static_cast<float>(NO_TABLE_INDEX);
+  bool matches(SymbolNumber s) const;
 
-class TransitionWIndex;
-class TransitionW;
+  TransitionTableIndex target(void) const
+  {
+    return target_index;
+  }
 
-typedef std::multimap<Weight, std::string> DisplayMultiMap;
-typedef std::map<std::string, Weight> DisplayMap;
+  SymbolNumber get_output(void) const
+  {
+    return output_symbol;
+  }
 
-typedef std::vector<TransitionWIndex*> TransitionWIndexVector;
-typedef std::vector<TransitionW*> TransitionWVector;
+  SymbolNumber get_input(void) const
+  {
+    return input_symbol;
+  }
+  
+  bool final(void) const
+  {
+    return target_index == 1;
+  }
+};
 
-class TransitionWIndex
+class PACKED_RECORD TransitionWIndex
 {
  private:
   SymbolNumber input_symbol;
@@ -696,20 +796,20 @@ class TransitionWIndex
     first_transition_index(first_transition)
     {}
 
-  bool matches(SymbolNumber s);
+  bool matches(SymbolNumber s) const;
   
-  TransitionTableIndex target(void)
+  TransitionTableIndex target(void) const
   {
     return first_transition_index;
   }
   
-  bool final(void)
+  bool final(void) const
   {
       return input_symbol == NO_SYMBOL_NUMBER &&
 	  first_transition_index != NO_TABLE_INDEX;
   }
   
-  Weight final_weight(void)
+  Weight final_weight(void) const
   {
       union to_weight
       {
@@ -720,13 +820,13 @@ class TransitionWIndex
       return weight.w;
   }
   
-  SymbolNumber get_input(void)
+  SymbolNumber get_input(void) const
   {
     return input_symbol;
   }
 };
 
-class TransitionW
+class PACKED_RECORD TransitionW
 {
  private:
   SymbolNumber input_symbol;
@@ -758,29 +858,29 @@ class TransitionW
     transition_weight(INFINITE_WEIGHT)
     {}
 
-  bool matches(SymbolNumber s);
+  bool matches(SymbolNumber s) const;
 
-  TransitionTableIndex target(void)
+  TransitionTableIndex target(void) const
   {
     return target_index;
   }
 
-  SymbolNumber get_output(void)
+  SymbolNumber get_output(void) const
   {
     return output_symbol;
   }
 
-  SymbolNumber get_input(void)
+  SymbolNumber get_input(void) const
   {
     return input_symbol;
   }
   
-  Weight get_weight(void)
+  Weight get_weight(void) const
   {
     return transition_weight;
   }
 
-  bool final(void)
+  bool final(void) const
   {
       return input_symbol == NO_SYMBOL_NUMBER &&
 	  output_symbol == NO_SYMBOL_NUMBER &&
@@ -788,267 +888,634 @@ class TransitionW
   }
 };
 
-class IndexTableReaderW
+typedef const TransitionIndex * TransitionIndexVector;
+typedef const Transition * TransitionVector;
+typedef const TransitionWIndex * TransitionWIndexVector;
+typedef const TransitionW * TransitionWVector;
+
+// The readers work for either kind of record, IndexRecord being
+// TransitionIndex or TransitionWIndex and TransitionRecord being
+// Transition or TransitionW.
+
+template <class IndexRecord>
+class IndexTableReader
 {
  private:
   TransitionTableIndex number_of_table_entries;
-  char * TableIndices;
-  TransitionWIndexVector indices;
-  size_t table_size;
+  const IndexRecord * indices;
   
-  void get_index_vector(void);
  public:
- IndexTableReaderW(FILE * f,
-			  TransitionTableIndex index_count): 
-  number_of_table_entries(index_count)
+ IndexTableReader(const char * table,
+		  TransitionTableIndex index_count): 
+  number_of_table_entries(index_count),
+    indices((const IndexRecord *)(table))
     {
-      table_size = number_of_table_entries*TransitionWIndex::SIZE;
-      TableIndices = (char*)(malloc(table_size));
-
-      // This dummy variable is needed, since the compiler complains
-      // for not catching the return value of fread().
-      int dummy_number_of_bytes;
-
-      dummy_number_of_bytes = fread(TableIndices,table_size,1,f);
-      get_index_vector();
+      assert(sizeof(IndexRecord) == IndexRecord::SIZE);
     }
   
+  static size_t table_size(TransitionTableIndex index_count)
+  {
+    return index_count * IndexRecord::SIZE;
+  }
+
   bool get_finality(TransitionTableIndex i)
   {
-    return indices[i]->final();
+    return indices[i].final();
   }
   
-  TransitionWIndex * at(TransitionTableIndex i)
+  const IndexRecord &at(TransitionTableIndex i)
   {
     return indices[i];
   }
   
-  TransitionWIndexVector &operator() (void)
+  TransitionTableIndex size(void)
+  { return number_of_table_entries; }
+
+  const IndexRecord * operator() (void) const
     { return indices; }
 };
 
-class TransitionTableReaderW
+template <class TransitionRecord>
+class TransitionTableReader
 {
-
- private:
+ protected:
   TransitionTableIndex number_of_table_entries;
-  char * TableTransitions;
-  TransitionWVector transitions;
-  size_t table_size;
-  
-  TransitionTableIndex position;
+  const TransitionRecord * transitions;
   
-  void get_transition_vector(void);
-
  public:
- TransitionTableReaderW(FILE * f,
-			       TransitionTableIndex transition_count):
+ TransitionTableReader(const char * table,
+		       TransitionTableIndex transition_count):
   number_of_table_entries(transition_count),
-    position(0)
+    transitions((const TransitionRecord *)(table))
       {
-	table_size = number_of_table_entries*TransitionW::SIZE;
-	TableTransitions = (char*)(malloc(table_size));
-	int bytes;
-	bytes = fread(TableTransitions,table_size,1,f);
-	get_transition_vector();
+	assert(sizeof(TransitionRecord) == TransitionRecord::SIZE);
       }
   
-  void Set(TransitionTableIndex pos);
-
-  TransitionW * at(TransitionTableIndex i)
+  static size_t table_size(TransitionTableIndex transition_count)
   {
-    return transitions[i - TRANSITION_TARGET_TABLE_START];
+    return transition_count * TransitionRecord::SIZE;
   }
 
-  void Next(void)
+  const TransitionRecord &at(TransitionTableIndex i)
   {
-    ++position;
-  }
-  
-  bool Matches(SymbolNumber s);
-
-  TransitionTableIndex get_target(void)
-  {
-    return transitions[position]->target();
-  }
-
-  SymbolNumber get_output(void)
-  {
-    return transitions[position]->get_output();
+    return transitions[i - TRANSITION_TARGET_TABLE_START];
   }
 
-  SymbolNumber get_input(void)
+  bool get_finality(TransitionTableIndex i)
   {
-    return transitions[position]->get_input();
+    if (i >= TRANSITION_TARGET_TABLE_START)
+      {
+	return transitions[i - TRANSITION_TARGET_TABLE_START].final();
+      }
+    return transitions[i].final();
   }
 
-  bool get_finality(TransitionTableIndex i);
+  TransitionTableIndex size(void)
+  { return number_of_table_entries; }
 
-  TransitionWVector &operator() (void)
+  const TransitionRecord * operator() (void) const
     { 
       return transitions; 
     }
 };
 
-class TransducerW
-{
- protected:
-
-  TransducerHeader header;
-  TransducerAlphabet alphabet;
-  KeyTable * keys;
-  IndexTableReaderW index_reader;
-  TransitionTableReaderW transition_reader;
-  Encoder encoder;
-  DisplayMultiMap display_map;
+/*
+ * There is a single lookup routine, the Transducer template below. What
+ * used to be eight separate classes is now chosen at compile time from
+ * three policies: one for weights, one for flag diacritics and one for
+ * collecting the analyses. Every combination is a type of its own, so
+ * nothing in the traversal goes through a virtual call and the parts a
+ * transducer doesn't need compile away.
+ */
 
-  SymbolNumber * output_string;
+// Weight policies give the record types of the tables and the weights
+// read from them.
 
-  static const TransitionTableIndex START_INDEX = 0;
-
-  std::vector<const char*> symbol_table;
+class NoWeights
+{
+ public:
+  typedef TransitionIndex IndexRecord;
+  typedef Transition TransitionRecord;
 
-  TransitionWIndexVector &indices;
+  static const bool weighted = false;
 
-  TransitionWVector &transitions;
+  static Weight transition_weight(const Transition &)
+  { return 0.0; }
 
-  Weight current_weight;
+  static Weight final_weight(const TransitionIndex &)
+  { return 0.0; }
+};
 
-  void set_symbol_table(void);
+class TropicalWeights
+{
+ public:
+  typedef TransitionWIndex IndexRecord;
+  typedef TransitionW TransitionRecord;
 
-  virtual void try_epsilon_transitions(SymbolNumber * input_symbol,
-				       SymbolNumber * output_symbol,
-				       SymbolNumber * original_output_string,
-				       TransitionTableIndex i);
-  
-  void try_epsilon_indices(SymbolNumber * input_symbol,
-				   SymbolNumber * output_symbol,
-				   SymbolNumber * original_output_string,
-				   TransitionTableIndex i);
+  static const bool weighted = true;
 
-  void find_transitions(SymbolNumber input,
-			SymbolNumber * input_symbol,
-			SymbolNumber * output_symbol,
-			SymbolNumber * original_output_string,
-			TransitionTableIndex i);
+  static Weight transition_weight(const TransitionW & t)
+  { return t.get_weight(); }
 
-  void find_index(SymbolNumber input,
-		  SymbolNumber * input_symbol,
-		  SymbolNumber * output_symbol,
-		  SymbolNumber * original_output_string,
-		  TransitionTableIndex i);
+  static Weight final_weight(const TransitionWIndex & i)
+  { return i.final_weight(); }
+};
 
-  virtual void note_analysis(SymbolNumber * whole_output_string);
+/*
+ * Everything read from the transducer file: the header, the symbols, the
+ * tables and the encoder for the input. Nothing here changes during lookup,
+ * so one model is shared by all the Transducers looking up with it, in any
+ * number of threads, without locking or copying.
+ */
+template <class WeightPolicy>
+class TransducerModel
+{
+ public:
+  typedef typename WeightPolicy::IndexRecord IndexRecord;
+  typedef typename WeightPolicy::TransitionRecord TransitionRecord;
 
-  bool final_transition(TransitionTableIndex i)
+ private:
+  TransducerHeader header;
+  TransducerAlphabet alphabet;
+  IndexTableReader<IndexRecord> index_reader;
+  TransitionTableReader<TransitionRecord> transition_reader;
+  Encoder encoder;
+  std::vector<const char*> symbol_table;
+  std::vector<SymbolClass> symbol_classes;
+  // The symbols as printed: those that outputProjection leaves out are
+  // empty, so that printing an analysis needs no checks
+  std::vector<const char*> output_symbol_table;
+  // Paths can only be cut off at a weight bound if no weight makes a path
+  // lighter. The tables are only scanned for it if there is a bound.
+  bool nonnegative_weights;
+
+  bool find_nonnegative_weights(void) const
   {
-    return transitions[i]->final();
+    const TransitionRecord * t = transitions();
+    for (TransitionTableIndex i = 0; i < header.target_table_size(); ++i)
+      {
+	if (!(WeightPolicy::transition_weight(t[i]) >= 0.0))
+	  {
+	    return false;
+	  }
+      }
+    const IndexRecord * index = indices();
+    for (TransitionTableIndex i = 0; i < header.index_table_size(); ++i)
+      {
+	if (index[i].final() && !(WeightPolicy::final_weight(index[i]) >= 0.0))
+	  {
+	    return false;
+	  }
+      }
+    return true;
   }
-  
-  bool final_index(TransitionTableIndex i)
+
+  // Not copyable: the Transducers keep references into it
+  TransducerModel(const TransducerModel &);
+  TransducerModel & operator=(const TransducerModel &);
+
+ public:
+ TransducerModel(const char * tables, TransducerHeader h, TransducerAlphabet a):
+  header(h),
+    alphabet(a),
+    index_reader(tables, header.index_table_size()),
+    transition_reader(tables + IndexTableReader<IndexRecord>::table_size(header.index_table_size()),
+		      header.target_table_size()),
+    encoder(alphabet.get_key_table(), header.input_symbol_count()),
+    symbol_table(),
+    symbol_classes(),
+    output_symbol_table(),
+    nonnegative_weights(false)
+      {
+	KeyTable * keys = alphabet.get_key_table();
+	const OperationVector & operations = alphabet.get_operations();
+	for (KeyTable::iterator it = keys->begin(); it != keys->end(); ++it)
+	  {
+	    symbol_table.push_back(it->second);
+	    bool flag = it->first < operations.size() && operations[it->first].isFlag();
+	    symbol_classes.push_back(classify_symbol(it->second, flag));
+	    output_symbol_table.push_back(projected(symbol_classes.back()) ?
+					  it->second : "");
+	  }
+	nonnegative_weights = WeightPolicy::weighted &&
+	  (maxAnalyses < INT_MAX ||
+	   beamWidth < std::numeric_limits<Weight>::infinity() ||
+	   maxWeight < std::numeric_limits<Weight>::infinity()) &&
+	  find_nonnegative_weights();
+      }
+
+  static bool projected(SymbolClass c)
   {
-    return indices[i]->final();
+    switch (outputProjection) {
+    case FULL: return true;
+    case LEMMA: case LEMMA_POS: return c == LEMMA_SYMBOL;
+    case TAGS: return c == TAG_SYMBOL;
+    }
+    return true;
   }
 
-  void get_analyses(SymbolNumber * input_symbol,
-		    SymbolNumber * output_symbol,
-		    SymbolNumber * original_output_string,
-		    TransitionTableIndex i);
+  const TransducerHeader & get_header(void) const
+  { return header; }
 
-  Weight get_final_index_weight(TransitionTableIndex i) {
-    return indices[i]->final_weight();
-  }
+  const TransducerAlphabet & get_alphabet(void) const
+  { return alphabet; }
 
-  Weight get_final_transition_weight(TransitionTableIndex i) {
-    return transitions[i]->get_weight();
-  }
+  const IndexRecord * indices(void) const
+  { return index_reader(); }
 
- public:
- TransducerW(FILE * f, TransducerHeader h, TransducerAlphabet a) :
-  header(h),
-    alphabet(a),
-    keys(alphabet.get_key_table()),
-    index_reader(f,header.index_table_size()),
-    transition_reader(f,header.target_table_size()),
-    encoder(keys,header.input_symbol_count()),
-    display_map(),
-    output_string((SymbolNumber*)(malloc(2000))),
-    indices(index_reader()),
-    transitions(transition_reader()),
-    current_weight(0.0)
+  const TransitionRecord * transitions(void) const
+  { return transition_reader(); }
+
+  const std::vector<const char*> & symbols(void) const
+  { return symbol_table; }
+
+  bool weights_are_nonnegative(void) const
+  { return nonnegative_weights; }
+
+  const std::vector<const char*> & output_symbols(void) const
+  { return output_symbol_table; }
+
+  // With --project=lemma+pos, the first tag after the last lemma symbol of
+  // the output, or NO_SYMBOL_NUMBER if there isn't one
+  SymbolNumber part_of_speech(const SymbolNumber * output) const
+  {
+    const SymbolNumber * after_lemma = output;
+    for (const SymbolNumber * s = output; *s != NO_SYMBOL_NUMBER; ++s)
       {
-	for (int i = 0; i < 1000; ++i)
+	if (symbol_classes[*s] == LEMMA_SYMBOL)
 	  {
-	    output_string[i] = NO_SYMBOL_NUMBER;
+	    after_lemma = s + 1;
 	  }
-	set_symbol_table();
       }
+    for (const SymbolNumber * s = after_lemma; *s != NO_SYMBOL_NUMBER; ++s)
+      {
+	if (symbol_classes[*s] == TAG_SYMBOL)
+	  {
+	    return *s;
+	  }
+      }
+    return NO_SYMBOL_NUMBER;
+  }
+
+  SymbolNumber find_next_key(char ** p) const
+  { return encoder.find_key(p); }
+
+  bool encode(char * str, size_t length, SymbolNumber * symbols) const
+  { return encoder.encode(str, length, symbols); }
+};
+
+// Flag diacritic policies decide which epsilon-like input symbols are flags
+// and whether the current flag state lets them through.
+
+class NoFlags
+{
+ public:
+  NoFlags(const TransducerAlphabet &)
+    {}
+
+  bool is_flag(SymbolNumber) const
+  { return false; }
 
-  KeyTable * get_key_table(void)
+  bool push_state(SymbolNumber)
+  { return true; }
+
+  void pop_state(void)
+  {}
+
+  size_t mark(void) const
+  { return 0; }
+
+  bool unchanged_since(size_t) const
+  { return true; }
+};
+
+/*
+ * The flag state is kept in one array that flags change in place. Each flag
+ * taken logs the old value of its feature, which pop_state() puts back, so
+ * taking and leaving a flag costs the same however many features there are.
+ */
+class FlagDiacritics
+{
+ private:
+  FlagDiacriticState state;
+  FlagDiacriticUndoLog undo_log;
+  const OperationVector & operations; // the model's
+
+  bool change(SymbolNumber feature, ValueNumber value)
   {
-    return keys;
+    undo_log.push_back(FlagDiacriticChange(feature, state[feature]));
+    state[feature] = value;
+    return true;
   }
 
-  void analyze(SymbolNumber * input_string)
+ public:
+ FlagDiacritics(const TransducerAlphabet & a):
+  state(a.get_state_size(), 0),
+    undo_log(),
+    operations(a.get_operations())
+    {}
+
+  bool is_flag(SymbolNumber s) const
   {
-    get_analyses(input_string,output_string,output_string,START_INDEX);
+    return s != NO_SYMBOL_NUMBER && operations[s].isFlag();
   }
 
+  // Push the state after flag s, or return false if s isn't allowed
+  bool push_state(SymbolNumber s);
 
-  SymbolNumber find_next_key(char ** p)
+  void pop_state(void)
   {
-    return encoder.find_key(p);
+    state[undo_log.back().first] = undo_log.back().second;
+    undo_log.pop_back();
   }
 
-  virtual void printAnalyses(std::string prepend);
+  // How far the state has been changed, to compare with later
+  size_t mark(void) const
+  { return undo_log.size(); }
+
+  // Whether the state is the same as it was at mark
+  bool unchanged_since(size_t mark) const;
 };
 
-class TransducerWUniq: public TransducerW
+// Result policies collect the analyses of one input and print them.
+
+class AllAnalyses
 {
  private:
-  DisplayMap display_map;
-  void note_analysis(SymbolNumber * whole_output_string);
+  const SymbolTable & symbol_table;
+  AnalysisArena arena;
+  DisplaySpanVector display_vector;
+
  public:
- TransducerWUniq(FILE * f, TransducerHeader h, TransducerAlphabet a):
-  TransducerW(f, h, a),
-    display_map()
-      {}
-  
-  void printAnalyses(std::string prepend);
+  static const bool unique = false;
+
+ AllAnalyses(const SymbolTable & symbols):
+  symbol_table(symbols),
+    arena(),
+    display_vector()
+    {}
+
+  // Note the analysis on output, printed with printed and followed by tag
+  bool note(const SymbolNumber * output, const SymbolTable & printed,
+	    SymbolNumber tag, Weight w)
+  {
+    display_vector.push_back(DisplaySpan(w, arena.add(output, printed, tag)));
+    return true;
+  }
+
+  bool empty(void) const
+  { return display_vector.empty(); }
+
+  // In the order they were found, lightest first if weighted, leaving
+  // out those heavier than max_weight
+  void print(OutputBuffer & out, const char * prepend, bool weighted,
+	     Weight max_weight);
 };
 
-class TransducerWFd: public TransducerW
+/*
+ * Analyses are told apart by an open-addressing hash table of the spans,
+ * hashed and compared by the text they spell, since different symbols
+ * may spell the same text. The slots are stamped with the input they
+ * were filled for, so starting on the next input clears none of them.
+ */
+class UniqueAnalyses
 {
-  FlagDiacriticStateStack statestack;
-  OperationVector operations;
+ private:
+  struct Slot
+  {
+    unsigned int generation; // the slot is empty unless this is current
+    unsigned int analysis; // in display_vector
+  };
 
-  void try_epsilon_transitions(SymbolNumber * input_symbol,
-			       SymbolNumber * output_symbol,
-			       SymbolNumber * original_output_string,
-			       TransitionTableIndex i);
+  const SymbolTable & symbol_table;
+  AnalysisArena arena;
+  DisplaySpanVector display_vector; // in the order they were found
+  std::vector<size_t> hashes; // of display_vector
+  std::vector<Slot> slots; // a power of two of them
+  unsigned int generation;
 
-  bool PushState(FlagDiacriticOperation op);
+  // The slot holding span, or the empty one it would go in
+  size_t find_slot(const SymbolSpan & span, size_t hash) const;
+
+  // Start over with slot_count empty slots and put the analyses back
+  void rehash(size_t slot_count);
 
-  
  public:
- TransducerWFd(FILE * f, TransducerHeader h, TransducerAlphabet a):
-  TransducerW(f, h, a),
-    statestack(1, FlagDiacriticState (a.get_state_size(), 0)),
-    operations(a.get_operation_vector())
-      {}
+  static const bool unique = true;
+
+ UniqueAnalyses(const SymbolTable & symbols):
+  symbol_table(symbols),
+    arena(),
+    display_vector(),
+    hashes(),
+    slots(64),
+    generation(1)
+    {
+      for (size_t i = 0; i < slots.size(); ++i)
+	{
+	  slots[i].generation = 0;
+	}
+    }
+
+  // An analysis found several times keeps its lowest weight. Returns
+  // whether it had not been found before.
+  bool note(const SymbolNumber * output, const SymbolTable & printed,
+	    SymbolNumber tag, Weight w);
+
+  bool empty(void) const
+  { return display_vector.empty(); }
+
+  // In the order they were found, lightest first if weighted, leaving
+  // out those heavier than max_weight
+  void print(OutputBuffer & out, const char * prepend, bool weighted,
+	     Weight max_weight);
 };
 
-class TransducerWFdUniq: public TransducerWFd
+/*
+ * A state being visited during lookup. The traversal keeps these on a stack
+ * of its own instead of recursing, so the depth of a lookup is bounded by
+ * the length of the output tape and not by the C stack.
+ */
+struct TraversalFrame
+{
+  enum Phase {EPSILONS, INPUT, MATCHES};
+
+  SymbolNumber * input_symbol;
+  SymbolNumber * output_symbol;
+  TransitionTableIndex state;
+  Weight weight; // of the path so far
+  TransitionTableIndex next; // the transition to try next in this phase
+  TransitionTableIndex taken; // the transition to the frame above
+  bool flag_taken; // whether taking it pushed a flag diacritic state
+  size_t flag_mark; // the flag diacritic state on entering the frame
+  Phase phase;
+};
+
+typedef std::vector<TraversalFrame> FrameStack;
+
+/*
+ * One lookup at a time with a TransducerModel. This holds only what a lookup
+ * changes, so each thread looks up with a Transducer of its own, all of them
+ * sharing the same model.
+ */
+template <class WeightPolicy, class FlagPolicy, class ResultPolicy>
+class Transducer
 {
- private:
-  DisplayMap display_map;
-  void note_analysis(SymbolNumber * whole_output_string);
  public:
- TransducerWFdUniq(FILE * f, TransducerHeader h, TransducerAlphabet a):
-  TransducerWFd(f, h, a),
-    display_map()
-      {}
+  typedef TransducerModel<WeightPolicy> Model;
+
+ protected:
+  typedef typename Model::IndexRecord IndexRecord;
+  typedef typename Model::TransitionRecord TransitionRecord;
+
+  const Model & model;
+  FlagPolicy flags;
+  ResultPolicy results;
+
+  SymbolNumberVector output_string;
+
+  // where printAnalyses() puts the analyses
+  OutputBuffer * out;
+
+  static const TransitionTableIndex START_INDEX = 0;
+
+  static const size_t INITIAL_FRAMES = 1000;
+
+  // One frame for each symbol of output_string. A path may take
+  // maxEpsilons more transitions than there are input symbols, which
+  // max_depth is the cutoff for. The frames grow only as deep paths need
+  // them, so the traversal checks depth against depth_limit, the lesser
+  // of max_depth and how many frames there are now.
+  FrameStack frames;
+  size_t depth;
+  size_t max_depth;
+  size_t depth_limit;
+
+  // If the transducer has epsilon cycles, an epsilon or flag diacritic
+  // that comes back to a state on the path without consuming input and
+  // without changing the flag diacritic state is not taken
+  bool check_cycles;
+
+  // Lookup stops once searchLimit analyses have been found
+  unsigned long found;
+  
+  // the symbols as printed, see TransducerModel::output_symbols()
+  const std::vector<const char*> & symbol_table;
+  
+  const IndexRecord * indices;
+  
+  const TransitionRecord * transitions;
+
+  // Analyses heavier than this are left out, and if pruning, paths
+  // heavier than path_bound are cut off as they can't lead to any others
+  Weight weight_bound;
+  Weight path_bound;
+  bool pruning;
+
+  // With -n, --beam or --max-weight on a weighted transducer, the bound
+  // is lowered as analyses are found. best_weights are the weights of the
+  // lightest ones so far, heaviest on top.
+  bool bounding;
+  std::vector<Weight> best_weights;
+
+  // Returns whether the analysis had not been found before
+  bool note_analysis(SymbolNumber * whole_output_string, Weight w);
+
+  // Lower weight_bound to the beam above the lightest analysis found, and
+  // to the weight of the maxAnalyses'th lightest once that many have
+  // been found
+  void tighten_bound(Weight w, bool new_analysis);
+
+  bool final_transition(TransitionTableIndex i)
+  {
+    return transitions[i].final();
+  }
   
-  void printAnalyses(std::string prepend);
+  bool final_index(TransitionTableIndex i)
+  {
+    return indices[i].final();
+  }
+
+  // Start visiting state i
+  void enter_state(SymbolNumber * input_symbol,
+		   SymbolNumber * output_symbol,
+		   TransitionTableIndex i,
+		   Weight w);
+
+  // Take transition i out of the top frame, consuming input if matched
+  void take_transition(TransitionTableIndex i, bool flag, bool matched);
+
+  // Take the next epsilon or allowed flag diacritic out of the top frame,
+  // if there is one left
+  bool try_epsilons(void);
+
+  // Done with the top frame; undo the transition that led to it
+  void leave_state(void);
+
+  // Make room for deeper paths, or return false if they'd go beyond
+  // max_depth
+  bool grow_frames(void);
+
+  // Whether entering state would go round an epsilon cycle
+  bool revisits(TransitionTableIndex state,
+		const SymbolNumber * input_symbol) const;
+
+  // The first epsilon or flag diacritic out of state, if it has any
+  TransitionTableIndex first_epsilon(TransitionTableIndex state);
+
+  // The first transition out of state that may match input
+  TransitionTableIndex first_match(TransitionTableIndex state,
+				   SymbolNumber input);
+
+  void note_final(const TraversalFrame & frame);
+  
+  void get_analyses(SymbolNumber * input_symbol,
+		    SymbolNumber * output_symbol,
+		    TransitionTableIndex i);
+
+  Transducer(const Transducer &);
+  Transducer & operator=(const Transducer &);
+
+ public:
+ explicit Transducer(const Model & m):
+  model(m),
+    flags(model.get_alphabet()),
+    results(model.symbols()),
+    output_string(INITIAL_FRAMES, NO_SYMBOL_NUMBER),
+    out(&output),
+    frames(INITIAL_FRAMES),
+    depth(0),
+    max_depth(0),
+    depth_limit(0),
+    check_cycles(model.get_header().probe_flag(Has_input_epsilon_cycles) ||
+		 model.get_header().probe_flag(Has_unweighted_input_epsilon_cycles)),
+    found(0),
+    symbol_table(model.output_symbols()),
+    indices(model.indices()),
+    transitions(model.transitions()),
+    weight_bound(std::numeric_limits<Weight>::infinity()),
+    path_bound(std::numeric_limits<Weight>::infinity()),
+    pruning(false),
+    bounding(false),
+    best_weights()
+      {}
+
+  SymbolNumber find_next_key(char ** p) const
+  {
+    return model.find_next_key(p);
+  }
+
+  bool encode(char * str, size_t length, SymbolNumber * symbols) const
+  {
+    return model.encode(str, length, symbols);
+  }
+
+  void set_output(OutputBuffer & o)
+  {
+    out = &o;
+  }
+
+  void analyze(SymbolNumber * input_string);
 
+  void printAnalyses(const char * prepend);
 };